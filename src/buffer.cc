@@ -20,20 +20,76 @@
 
 #include "buffer.h"
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <cerrno>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <string>
 
 #include "transcode.h"
 
+namespace {
+
+pthread_mutex_t total_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Create an unnamed file on disk to hold spilled data. Unlike anonymous
+ * memory, its pages can be written out and reclaimed by the kernel even
+ * without swap. It is placed in the output store if there is one, and
+ * otherwise in TMPDIR or /var/tmp, as /tmp is often held in memory.
+ */
+int create_spill_file() {
+    const char* dir = params.cachedir;
+    int fd;
+
+    if (!dir) {
+        dir = getenv("TMPDIR");
+    }
+    if (!dir) {
+        dir = "/var/tmp";
+    }
+
+#ifdef O_TMPFILE
+    fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd != -1) {
+        return fd;
+    }
+#endif
+
+    std::string name = std::string(dir) + "/mp3fs.XXXXXX";
+    fd = mkstemp(&name[0]);
+    if (fd == -1) {
+        return -1;
+    }
+    unlink(name.c_str());
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    return fd;
+}
+
+}
+
+size_t Buffer::total_size = 0;
+
 /* Initially Buffer is empty. It will be allocated as needed. */
-Buffer::Buffer() : buffer_data(0), buffer_pos(0), buffer_size(0) { }
+Buffer::Buffer() : buffer_data(0), buffer_pos(0), buffer_size(0),
+    data_start(0), spill_size(0), spill_fd(-1) { }
 
 /* If buffer_data was never allocated, this is a no-op. */
 Buffer::~Buffer() {
     /* Have to work around OS X Mountain Lion bug */
     int olderrno = errno;
     free(buffer_data);
+    account(buffer_size, 0);
+    if (spill_fd != -1) {
+        close(spill_fd);
+    }
     errno = olderrno;
 }
 
@@ -72,8 +128,8 @@ size_t Buffer::write(const uint8_t* data, size_t length, size_t offset) {
  * should be updated afterward with increment_pos().
  */
 uint8_t* Buffer::write_prepare(size_t length) {
-    if (reallocate(buffer_pos + length)) {
-        return buffer_data + buffer_pos;
+    if (reallocate(buffer_pos - memory_start() + length)) {
+        return buffer_data + (buffer_pos - memory_start());
     } else {
         return NULL;
     }
@@ -82,11 +138,13 @@ uint8_t* Buffer::write_prepare(size_t length) {
 /*
  * Ensure the Buffer has sufficient space for a quantity of data written
  * to a particular location and return a pointer where the data may be
- * written.
+ * written. Data which has been spilled or discarded cannot be written
+ * this way.
  */
 uint8_t* Buffer::write_prepare(size_t length, size_t offset) {
-    if (reallocate(offset + length)) {
-        return buffer_data + offset;
+    if (offset >= memory_start()
+        && reallocate(offset - memory_start() + length)) {
+        return buffer_data + (offset - memory_start());
     } else {
         return NULL;
     }
@@ -106,9 +164,132 @@ size_t Buffer::tell() const {
     return buffer_pos;
 }
 
-/* Copy buffered data into output buffer. */
-void Buffer::copy_into(uint8_t* out_data, size_t offset, size_t size) const {
-    memcpy(out_data, buffer_data + offset, size);
+/* Give the offset of the first byte which has not been discarded. */
+size_t Buffer::start() const {
+    return data_start;
+}
+
+/*
+ * Copy buffered data into output buffer, reading any part which has been
+ * spilled back from the file. Discarded data cannot be copied.
+ */
+bool Buffer::copy_into(uint8_t* out_data, size_t offset, size_t size) const {
+    if (offset < data_start) {
+        return false;
+    }
+
+    while (offset < spill_size && size > 0) {
+        ssize_t ret = pread(spill_fd, out_data,
+                            std::min(size, spill_size - offset), offset);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        } else if (ret <= 0) {
+            return false;
+        }
+        out_data += ret;
+        offset += ret;
+        size -= ret;
+    }
+
+    if (size > 0) {
+        memcpy(out_data, buffer_data + (offset - memory_start()), size);
+    }
+
+    return true;
+}
+
+/*
+ * Move all data written so far out of memory into an unnamed file, which
+ * is created the first time. If this fails, the data stays in memory.
+ */
+bool Buffer::spill() {
+    if (spill_fd == -1) {
+        spill_fd = create_spill_file();
+        if (spill_fd == -1) {
+            return false;
+        }
+    }
+
+    size_t base = memory_start();
+    size_t length = buffer_pos - base;
+    size_t written = 0;
+    while (written < length) {
+        ssize_t ret = pwrite(spill_fd, buffer_data + written,
+                             length - written, base + written);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        written += ret;
+    }
+
+    free(buffer_data);
+    account(buffer_size, 0);
+    buffer_data = NULL;
+    buffer_size = 0;
+    spill_size = buffer_pos;
+
+    return true;
+}
+
+/*
+ * Discard all data before offset, which must not be beyond the position
+ * pointer. The memory is kept for the data written next.
+ */
+void Buffer::discard(size_t offset) {
+    if (offset <= data_start) {
+        return;
+    }
+
+    size_t base = memory_start();
+    data_start = offset;
+    if (offset > base) {
+        memmove(buffer_data, buffer_data + (offset - base),
+                buffer_pos - offset);
+    }
+}
+
+/* Drop all data, and return the Buffer to its initial empty state. */
+void Buffer::reset() {
+    int olderrno = errno;
+    free(buffer_data);
+    account(buffer_size, 0);
+    if (spill_fd != -1) {
+        close(spill_fd);
+    }
+    errno = olderrno;
+
+    buffer_data = NULL;
+    buffer_pos = 0;
+    buffer_size = 0;
+    data_start = 0;
+    spill_size = 0;
+    spill_fd = -1;
+}
+
+/*
+ * Give a file descriptor holding all of the data, if it has all been
+ * spilled and none discarded, or -1 otherwise. It remains owned by the
+ * Buffer.
+ */
+int Buffer::spilled_fd() const {
+    return spill_size == buffer_pos && data_start == 0 ? spill_fd : -1;
+}
+
+/* Give the amount of memory allocated by this Buffer. */
+size_t Buffer::allocated() const {
+    return buffer_size;
+}
+
+/* Give the amount of memory allocated by all Buffers together. */
+size_t Buffer::total_allocated() {
+    pthread_mutex_lock(&total_lock);
+    size_t size = total_size;
+    pthread_mutex_unlock(&total_lock);
+
+    return size;
 }
 
 /*
@@ -135,9 +316,25 @@ bool Buffer::reallocate(size_t size) {
 
         mp3fs_debug("Buffer reallocate: %p -> %p ; %lu -> %lu", buffer_data, newdata, buffer_size, size);
 
+        account(buffer_size, size);
         buffer_data = newdata;
         buffer_size = size;
     }
 
     return true;
 }
+
+/* Keep track of the memory allocated by all Buffers. */
+void Buffer::account(size_t old_size, size_t new_size) {
+    pthread_mutex_lock(&total_lock);
+    total_size = total_size - old_size + new_size;
+    pthread_mutex_unlock(&total_lock);
+}
+
+/*
+ * Give the offset of the first byte held in memory. Data before it has
+ * been spilled or discarded.
+ */
+size_t Buffer::memory_start() const {
+    return std::max(data_start, spill_size);
+}
@@ -25,6 +25,13 @@
 
 #include <cstddef>
 
+/*
+ * Growable data buffer. The memory used by all Buffers is counted, and
+ * the data written so far can be spilled to an unnamed file to release
+ * it; later writes go to memory again and reads draw from both. Data
+ * before a given offset can also be discarded entirely, for callers which
+ * only need a window of recent data.
+ */
 class Buffer {
 public:
     Buffer();
@@ -36,12 +43,25 @@ public:
     uint8_t* write_prepare(size_t length, size_t offset);
     void increment_pos(ptrdiff_t increment);
     size_t tell() const;
-    void copy_into(uint8_t* out_data, size_t offset, size_t size) const;
+    size_t start() const;
+    bool copy_into(uint8_t* out_data, size_t offset, size_t size) const;
+    bool spill();
+    void discard(size_t offset);
+    void reset();
+    int spilled_fd() const;
+    size_t allocated() const;
+    static size_t total_allocated();
 private:
     bool reallocate(size_t size);
+    void account(size_t old_size, size_t new_size);
+    size_t memory_start() const;
     uint8_t* buffer_data;
     size_t buffer_pos;
     size_t buffer_size;
+    size_t data_start;
+    size_t spill_size;
+    int spill_fd;
+    static size_t total_size;
 };
 
 #endif
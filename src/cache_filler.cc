@@ -0,0 +1,231 @@
+/*
+ * Background output store filler source for mp3fs
+ *
+ * Copyright (C) 2013 Kristofer Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "cache_filler.h"
+
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#include "scheduler.h"
+#include "transcode.h"
+
+namespace {
+
+/* Protects all of the static filler state. */
+pthread_mutex_t filler_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Signalled when files are queued, and when reads finish. */
+pthread_cond_t filler_cond = PTHREAD_COND_INITIALIZER;
+
+/* Limit on the number of files waiting to be stored. */
+const size_t max_queued = 1024;
+
+/* Seconds without reads after which the filesystem counts as idle. */
+const time_t idle_delay = 2;
+
+}
+
+std::list<std::string> CacheFiller::queue;
+std::set<std::string> CacheFiller::queued;
+int CacheFiller::active_reads = 0;
+time_t CacheFiller::last_read = 0;
+bool CacheFiller::started = false;
+pthread_t CacheFiller::worker;
+
+/*
+ * Start the worker thread, if enabled. This must happen after FUSE has
+ * put the process in the background, as threads do not survive that.
+ */
+void CacheFiller::start() {
+    if (!params.cachefill) {
+        return;
+    }
+
+    pthread_mutex_lock(&filler_lock);
+    if (!started) {
+        if (pthread_create(&worker, NULL, run, NULL) == 0) {
+            pthread_detach(worker);
+            started = true;
+        } else {
+            mp3fs_error("Unable to start cache filler thread.");
+        }
+    }
+    pthread_mutex_unlock(&filler_lock);
+}
+
+/* Queue a source file to be stored, unless it is already queued. */
+void CacheFiller::add(const std::string& filename) {
+    if (!params.cachefill || is_worker()) {
+        return;
+    }
+
+    pthread_mutex_lock(&filler_lock);
+    if (queued.size() < max_queued && queued.insert(filename).second) {
+        queue.push_back(filename);
+        pthread_cond_broadcast(&filler_cond);
+    }
+    pthread_mutex_unlock(&filler_lock);
+}
+
+/*
+ * Queue the other source files in the directory of a file being played.
+ * The files following it in name order come first, as they are most
+ * likely to be played next.
+ */
+void CacheFiller::add_siblings(const std::string& filename) {
+    if (!params.cachefill || is_worker()) {
+        return;
+    }
+
+    size_t slash = filename.rfind('/');
+    if (slash == std::string::npos) {
+        return;
+    }
+    std::string dirname = filename.substr(0, slash);
+    std::string name = filename.substr(slash + 1);
+
+    DIR* dp = opendir(dirname.empty() ? "/" : dirname.c_str());
+    if (!dp) {
+        errno = 0;
+        return;
+    }
+
+    std::vector<std::string> names;
+    struct dirent* de;
+    while ((de = readdir(dp))) {
+        const char* ext = strrchr(de->d_name, '.');
+        if (ext && check_decoder(ext + 1) && name != de->d_name) {
+            names.push_back(de->d_name);
+        }
+    }
+    closedir(dp);
+    errno = 0;
+
+    std::sort(names.begin(), names.end());
+    std::vector<std::string>::iterator next
+        = std::upper_bound(names.begin(), names.end(), name);
+    std::rotate(names.begin(), next, names.end());
+
+    for (size_t i=0; i<names.size(); ++i) {
+        add(dirname + "/" + names[i]);
+    }
+}
+
+/* Note that a file is being read, other than by the worker. */
+void CacheFiller::read_started() {
+    if (!params.cachefill || is_worker()) {
+        return;
+    }
+
+    pthread_mutex_lock(&filler_lock);
+    ++active_reads;
+    pthread_mutex_unlock(&filler_lock);
+}
+
+/* Note that reading a file has finished, other than by the worker. */
+void CacheFiller::read_finished() {
+    if (!params.cachefill || is_worker()) {
+        return;
+    }
+
+    pthread_mutex_lock(&filler_lock);
+    --active_reads;
+    last_read = time(NULL);
+    pthread_mutex_unlock(&filler_lock);
+}
+
+/*
+ * Store queued files one at a time. The thread runs at the lowest CPU
+ * priority, so that it gives way to reads as soon as they need the CPU.
+ */
+void* CacheFiller::run(void* arg) {
+    (void)arg;
+
+    Scheduler::set_priority(Scheduler::FILL);
+
+#ifdef SYS_gettid
+    /* On Linux, the nice value applies to the calling thread only. */
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+#endif
+
+    while (true) {
+        pthread_mutex_lock(&filler_lock);
+        while (queue.empty()) {
+            pthread_cond_wait(&filler_cond, &filler_lock);
+        }
+        std::string filename = queue.front();
+        queue.pop_front();
+        pthread_mutex_unlock(&filler_lock);
+
+        wait_idle();
+
+        if (!outputcache_check(filename.c_str())) {
+            mp3fs_debug("Storing %s in the background.", filename.c_str());
+            if (outputcache_fill(filename.c_str(), yield) == -1) {
+                mp3fs_debug("Unable to store %s.", filename.c_str());
+            }
+        }
+
+        pthread_mutex_lock(&filler_lock);
+        queued.erase(filename);
+        pthread_mutex_unlock(&filler_lock);
+    }
+
+    return NULL;
+}
+
+/* Wait until no file has been read for a while. */
+void CacheFiller::wait_idle() {
+    pthread_mutex_lock(&filler_lock);
+    while (active_reads > 0 || time(NULL) - last_read < idle_delay) {
+        struct timespec until;
+        until.tv_sec = time(NULL) + 1;
+        until.tv_nsec = 0;
+        pthread_cond_timedwait(&filler_cond, &filler_lock, &until);
+    }
+    pthread_mutex_unlock(&filler_lock);
+}
+
+/* Called as output is produced, to stop while files are being read. */
+void CacheFiller::yield(size_t bytes) {
+    (void)bytes;
+    wait_idle();
+}
+
+/* Check whether the calling thread is the worker. */
+bool CacheFiller::is_worker() {
+    return started && pthread_equal(pthread_self(), worker);
+}
+
+/* Use "C" linkage to allow access from C code. */
+extern "C" {
+
+void cachefill_start() {
+    CacheFiller::start();
+}
+
+}
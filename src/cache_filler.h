@@ -0,0 +1,60 @@
+/*
+ * Background output store filler header for mp3fs
+ *
+ * Copyright (C) 2013 Kristofer Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef CACHE_FILLER_H
+#define CACHE_FILLER_H
+
+#include <pthread.h>
+
+#include <cstddef>
+#include <ctime>
+#include <list>
+#include <set>
+#include <string>
+
+/*
+ * Worker thread which fills the OutputCache while the filesystem is
+ * otherwise idle. Files are queued when they appear in a source
+ * directory, and when a file in the same directory is played. The worker
+ * runs at low priority, only starts when no file has been read for a
+ * while, and waits whenever a file is read meanwhile.
+ */
+class CacheFiller {
+public:
+    static void start();
+    static void add(const std::string& filename);
+    static void add_siblings(const std::string& filename);
+    static void read_started();
+    static void read_finished();
+    static bool is_worker();
+private:
+    static void* run(void* arg);
+    static void wait_idle();
+    static void yield(size_t bytes);
+
+    static std::list<std::string> queue;
+    static std::set<std::string> queued;
+    static int active_reads;
+    static time_t last_read;
+    static bool started;
+    static pthread_t worker;
+};
+
+#endif
@@ -22,6 +22,8 @@
 
 #include "transcode.h"
 
+#include <cstring>
+
 /*
  * Conditionally include specific encoders and decoders based on
  * configuration.
@@ -33,20 +35,75 @@
 #include "flac_decoder.h"
 #endif
 
-/* Create instance of class derived from Encoder. */
-Encoder* Encoder::CreateEncoder(std::string file_type) {
+namespace {
+
+/* Factory functions for the available codecs. */
 #ifdef HAVE_MP3
-    if (file_type == "mp3") return new Mp3Encoder();
+Encoder* create_mp3_encoder() { return new Mp3Encoder(); }
 #endif
-    return NULL;
+#ifdef HAVE_FLAC
+Decoder* create_flac_decoder() { return FlacDecoder::create(); }
+#endif
+
+/*
+ * Registries of available encoders and decoders, by file extension. These
+ * answer whether a type is supported without constructing a codec.
+ */
+const struct {
+    const char* type;
+    Encoder* (*create)();
+} encoder_registry[] = {
+#ifdef HAVE_MP3
+    { "mp3", create_mp3_encoder },
+#endif
+};
+
+const struct {
+    const char* type;
+    Decoder* (*create)();
+} decoder_registry[] = {
+#ifdef HAVE_FLAC
+    { "flac", create_flac_decoder },
+#endif
+};
+
+const size_t encoder_registry_size
+    = sizeof(encoder_registry)/sizeof(encoder_registry[0]);
+const size_t decoder_registry_size
+    = sizeof(decoder_registry)/sizeof(decoder_registry[0]);
+
+/* Find the registry index of an encoder, or -1 if unsupported. */
+int find_encoder(const char* type) {
+    for (size_t i=0; i<encoder_registry_size; ++i) {
+        if (strcmp(type, encoder_registry[i].type) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+/* Find the registry index of a decoder, or -1 if unsupported. */
+int find_decoder(const char* type) {
+    for (size_t i=0; i<decoder_registry_size; ++i) {
+        if (strcmp(type, decoder_registry[i].type) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+}
+
+/* Create instance of class derived from Encoder. */
+Encoder* Encoder::CreateEncoder(std::string file_type) {
+    int i = find_encoder(file_type.c_str());
+    return i == -1 ? NULL : encoder_registry[i].create();
 }
 
 /* Create instance of class derived from Decoder. */
 Decoder* Decoder::CreateDecoder(std::string file_type) {
-#ifdef HAVE_FLAC
-    if (file_type == "flac") return new FlacDecoder();
-#endif
-    return NULL;
+    int i = find_decoder(file_type.c_str());
+    return i == -1 ? NULL : decoder_registry[i].create();
 }
 
 /* Define list of available encoder extensions. */
@@ -56,7 +113,7 @@ const char* encoder_list[] = {
 #endif
 };
 
-const size_t sizeof_encoder_list = sizeof(encoder_list);
+const size_t sizeof_encoder_list = sizeof(encoder_list)/sizeof(encoder_list[0]);
 
 /* Define list of available decoder extensions. */
 const char* decoder_list[] = {
@@ -65,31 +122,19 @@ const char* decoder_list[] = {
 #endif
 };
 
-const size_t sizeof_decoder_list = sizeof(decoder_list);
+const size_t sizeof_decoder_list = sizeof(decoder_list)/sizeof(decoder_list[0]);
 
 /* Use "C" linkage to allow access from C code. */
 extern "C" {
 
     /* Check if an encoder is available to encode to the specified type. */
     int check_encoder(const char* type) {
-        Encoder* enc = Encoder::CreateEncoder(type);
-        if (enc) {
-            delete enc;
-            return 1;
-        } else {
-            return 0;
-        }
+        return find_encoder(type) != -1;
     }
 
     /* Check if a decoder is available to decode from the specified type. */
     int check_decoder(const char* type) {
-        Decoder* dec = Decoder::CreateDecoder(type);
-        if (dec) {
-            delete dec;
-            return 1;
-        } else {
-            return 0;
-        }
+        return find_decoder(type) != -1;
     }
 
 }
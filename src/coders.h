@@ -70,10 +70,11 @@ public:
     virtual void set_gain_db(const double dbgain) = 0;
     virtual int render_close_tag(Buffer& buffer) = 0;
     virtual int render_start_tag(Buffer& buffer) = 0;
-    virtual size_t calculate_size() const = 0;
+    virtual size_t calculate_size() = 0;
     virtual int encode_pcm_data(const int32_t* const data[], int numsamples,
                                 int sample_size, Buffer& buffer) = 0;
     virtual int encode_finish(Buffer& buffer) = 0;
+    virtual double output_rate() const = 0;
 
     static Encoder* CreateEncoder(const std::string file_type);
 };
@@ -87,6 +88,12 @@ public:
     virtual int process_metadata(Encoder* encoder) = 0;
     virtual int process_single_fr(Encoder* encoder, Buffer* buffer) = 0;
 
+    /*
+     * Dispose of the decoder once done with it. Decoders which can be
+     * used for another file may keep themselves for that instead.
+     */
+    virtual void release() { delete this; }
+
     static Decoder* CreateDecoder(const std::string file_type);
 };
 
@@ -0,0 +1,695 @@
+/*
+ * Directory listing cache source for mp3fs
+ *
+ * Copyright (C) 2013 Kristofer Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "dir_cache.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+#include <cerrno>
+#include <cstring>
+
+#include "cache_filler.h"
+
+namespace {
+
+/* Protects all of the static cache state. */
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Whether creating the inotify instance has been attempted. */
+bool inotify_started = false;
+
+/* Position of a type in decoder_list, or -1 if it cannot be decoded. */
+int decoder_index(const char* type) {
+    for (size_t i=0; i<sizeof_decoder_list; ++i) {
+        if (strcmp(type, decoder_list[i]) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+/* Limit on the number of files remembered as not existing. */
+const size_t max_absent = 4096;
+
+/*
+ * Remove trailing slashes from a directory name, so that each directory
+ * is cached under a single name.
+ */
+std::string normalize(const std::string& dirname) {
+    std::string result(dirname);
+    while (result.size() > 1 && result[result.size() - 1] == '/') {
+        result.erase(result.size() - 1);
+    }
+    return result;
+}
+
+/* Form the path of a file in a directory. */
+std::string join(const std::string& dirname, const std::string& name) {
+    if (!dirname.empty() && dirname[dirname.size() - 1] == '/') {
+        return dirname + name;
+    }
+    return dirname + "/" + name;
+}
+
+/*
+ * Split a path into its normalized directory name and its file name.
+ * Returns false if the path has no directory, or does not name an entry
+ * of it, as for a directory given with a trailing slash, "." or "..".
+ */
+bool split(const char* path, std::string& dirname, std::string& name) {
+    const char* slash = strrchr(path, '/');
+    if (!slash) {
+        return false;
+    }
+    name = slash + 1;
+    if (name.empty() || name == "." || name == "..") {
+        return false;
+    }
+    dirname = slash == path ? "/" : normalize(std::string(path, slash));
+    return true;
+}
+
+}
+
+DirCache::listing_map_t DirCache::listings;
+std::map<int,std::string> DirCache::watches;
+std::list<std::string> DirCache::lru;
+DirCache::absent_map_t DirCache::absents;
+std::list<std::string> DirCache::absent_lru;
+int DirCache::inotify_fd = -1;
+
+/*
+ * Pass the translated listing of a source directory to a filler
+ * function, from the cache if it is still valid. Returns 0 on success, or
+ * -1 with errno set if the directory cannot be read.
+ */
+int DirCache::readdir(const std::string& dirname, void* buf,
+                      dircache_filler_t filler) {
+    std::vector<Entry> entries;
+    name_map_t names;
+
+    if (params.dircache == 0) {
+        if (read_listing(dirname, entries, names) == -1) {
+            return -1;
+        }
+        fill(entries, buf, filler);
+        return 0;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    listing_map_t::iterator it;
+    if (current(dirname, it)) {
+        fill(it->second.entries, buf, filler);
+        pthread_mutex_unlock(&cache_lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    /*
+     * Listings without a watch are checked against the modification time
+     * of the directory. It is taken before reading, so that changes made
+     * during the read are noticed next time.
+     */
+    struct stat st;
+    if (stat(dirname.c_str(), &st) == -1) {
+        return -1;
+    }
+    time_t list_time = time(NULL);
+
+    pthread_mutex_lock(&cache_lock);
+    unsigned long serial = prepare(dirname)->second.serial;
+    pthread_mutex_unlock(&cache_lock);
+
+    if (read_listing(dirname, entries, names) == -1) {
+        return -1;
+    }
+    fill(entries, buf, filler);
+
+    /* Only store the listing if no change was seen while reading it. */
+    pthread_mutex_lock(&cache_lock);
+    it = listings.find(dirname);
+    if (it != listings.end() && it->second.serial == serial) {
+        it->second.entries.swap(entries);
+        it->second.names.swap(names);
+        it->second.valid = true;
+        it->second.mtime = st.st_mtime;
+        it->second.list_time = list_time;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return 0;
+}
+
+/*
+ * Find the source name of a translated name in a directory from its
+ * cached listing. Returns 1 and sets original if there is a source file,
+ * 0 if the listing shows there is none, and -1 if there is no current
+ * listing to tell.
+ */
+int DirCache::find_original(const std::string& dirname,
+                            const std::string& name, std::string& original) {
+    if (params.dircache == 0) {
+        return -1;
+    }
+
+    int ret = -1;
+    pthread_mutex_lock(&cache_lock);
+    listing_map_t::iterator it;
+    if (current(dirname, it)) {
+        name_map_t::const_iterator found = it->second.names.find(name);
+        if (found != it->second.names.end() && !found->second.empty()) {
+            original = found->second;
+            ret = 1;
+        } else {
+            ret = 0;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return ret;
+}
+
+/*
+ * Check whether a file is known not to exist, either from the current
+ * listing of its directory, or from an earlier failed lookup made since
+ * the directory was last modified.
+ */
+bool DirCache::absent(const std::string& dirname, const std::string& name) {
+    if (params.dircache == 0) {
+        return false;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    listing_map_t::iterator it;
+    if (current(dirname, it)) {
+        bool ret = it->second.names.find(name) == it->second.names.end();
+        pthread_mutex_unlock(&cache_lock);
+        return ret;
+    }
+
+    std::string path = join(dirname, name);
+    absent_map_t::iterator found = absents.find(path);
+    if (found == absents.end()) {
+        pthread_mutex_unlock(&cache_lock);
+        return false;
+    }
+    time_t mtime = found->second.mtime;
+    pthread_mutex_unlock(&cache_lock);
+
+    struct stat st;
+    if (stat(dirname.c_str(), &st) == 0 && st.st_mtime == mtime) {
+        return true;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    found = absents.find(path);
+    if (found != absents.end() && found->second.mtime == mtime) {
+        absent_lru.erase(found->second.lru_pos);
+        absents.erase(found);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    errno = 0;
+    return false;
+}
+
+/*
+ * Remember that a file did not exist, for lookups made no earlier than
+ * since. The entry is valid until its directory is modified, and is only
+ * made if the directory was last modified before since, so a file created
+ * during the lookup cannot be missed.
+ */
+void DirCache::add_absent(const std::string& dirname,
+                          const std::string& name, time_t since) {
+    if (params.dircache == 0) {
+        return;
+    }
+
+    struct stat st;
+    if (stat(dirname.c_str(), &st) == -1 || st.st_mtime >= since) {
+        errno = 0;
+        return;
+    }
+
+    std::string path = join(dirname, name);
+    pthread_mutex_lock(&cache_lock);
+    absent_map_t::iterator found = absents.find(path);
+    if (found != absents.end()) {
+        absent_lru.erase(found->second.lru_pos);
+        absents.erase(found);
+    }
+    absent_lru.push_front(path);
+    Absent& entry = absents[path];
+    entry.mtime = st.st_mtime;
+    entry.lru_pos = absent_lru.begin();
+    while (absents.size() > max_absent) {
+        absents.erase(absent_lru.back());
+        absent_lru.pop_back();
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Check for an up to date listing of a directory, and if there is one,
+ * set it to point at it and mark it as recently used. Must be called with
+ * the lock held. The lock is released while the modification time of a
+ * directory without a watch is checked.
+ */
+bool DirCache::current(const std::string& dirname,
+                       listing_map_t::iterator& it) {
+    drain_events();
+    it = listings.find(dirname);
+    if (it == listings.end() || !it->second.valid) {
+        return false;
+    }
+
+    if (it->second.wd == -1) {
+        /*
+         * A listing made in the same second as the last modification may
+         * have missed a change made later in that second.
+         */
+        time_t mtime = it->second.mtime;
+        if (mtime >= it->second.list_time) {
+            return false;
+        }
+
+        pthread_mutex_unlock(&cache_lock);
+        struct stat st;
+        int stat_ret = stat(dirname.c_str(), &st);
+        pthread_mutex_lock(&cache_lock);
+        if (stat_ret == -1) {
+            errno = 0;
+            return false;
+        }
+
+        it = listings.find(dirname);
+        if (it == listings.end() || !it->second.valid
+            || it->second.mtime != mtime || st.st_mtime != mtime) {
+            return false;
+        }
+    }
+
+    lru.splice(lru.begin(), lru, it->second.lru_pos);
+    return true;
+}
+
+/*
+ * Read a source directory, translating the names of files which will be
+ * transcoded. Only the file type is kept, which is all FUSE uses here. It
+ * is taken from the directory entry when the file system provides it.
+ * Otherwise, only entries whose names may need translating are examined,
+ * and the type of the rest is left for the kernel to look up if needed.
+ *
+ * Every name which can be looked up in the directory, translated or not,
+ * is also recorded, along with the source name for translated names.
+ *
+ * Where several entries end up with the same name, only one is listed: an
+ * untranslated file first, then sources in the order of decoder_list. The
+ * same order is used when finding source files without a listing.
+ */
+int DirCache::read_listing(const std::string& dirname,
+                           std::vector<Entry>& entries,
+                           name_map_t& names) {
+    DIR* dp = opendir(dirname.c_str());
+    if (!dp) {
+        return -1;
+    }
+
+    std::vector<int> priorities;
+    std::vector<std::string> sources;
+    std::map<std::string,size_t> chosen;
+    struct dirent* de;
+    while ((de = ::readdir(dp))) {
+        const char* ext = strrchr(de->d_name, '.');
+        int decoder = ext ? decoder_index(ext + 1) : -1;
+
+        Entry entry;
+        entry.name = de->d_name;
+        entry.ino = de->d_ino;
+        entry.mode = 0;
+#ifdef _DIRENT_HAVE_D_TYPE
+        if (de->d_type != DT_UNKNOWN) {
+            entry.mode = DTTOIF(de->d_type);
+        } else
+#endif
+        if (decoder != -1) {
+            struct stat st;
+            if (fstatat(dirfd(dp), de->d_name, &st,
+                        AT_SYMLINK_NOFOLLOW) == -1) {
+                /* Entry disappeared while listing; leave it out. */
+                errno = 0;
+                continue;
+            }
+            entry.mode = st.st_mode & S_IFMT;
+        }
+
+        int priority = 0;
+        if (decoder != -1 && (S_ISREG(entry.mode) || S_ISLNK(entry.mode))) {
+            entry.name.replace(ext - de->d_name + 1, std::string::npos,
+                               params.desttype);
+            priority = decoder + 1;
+        }
+
+        std::map<std::string,size_t>::iterator other
+            = chosen.find(entry.name);
+        if (other == chosen.end()) {
+            chosen[entry.name] = entries.size();
+        } else if (priority < priorities[other->second]) {
+            other->second = entries.size();
+        }
+
+        entries.push_back(entry);
+        priorities.push_back(priority);
+        sources.push_back(de->d_name);
+    }
+
+    closedir(dp);
+
+    /* Drop the entries which lost out to another of the same name. */
+    size_t kept = 0;
+    for (size_t i=0; i<entries.size(); ++i) {
+        if (chosen[entries[i].name] != i) {
+            continue;
+        }
+        names[entries[i].name] = priorities[i] > 0 ? sources[i] : "";
+        if (kept != i) {
+            entries[kept] = entries[i];
+        }
+        ++kept;
+    }
+    entries.resize(kept);
+
+    /* Source names can still be looked up directly. */
+    for (size_t i=0; i<sources.size(); ++i) {
+        names.insert(std::make_pair(sources[i], std::string()));
+    }
+
+    errno = 0;
+    return 0;
+}
+
+/* Pass listing entries to a filler function. */
+void DirCache::fill(const std::vector<Entry>& entries, void* buf,
+                    dircache_filler_t filler) {
+    for (size_t i=0; i<entries.size(); ++i) {
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        st.st_ino = entries[i].ino;
+        st.st_mode = entries[i].mode;
+        if (filler(buf, entries[i].name.c_str(),
+                   entries[i].mode ? &st : NULL)) {
+            break;
+        }
+    }
+}
+
+/*
+ * Find the cache entry for a directory, creating an empty one with a
+ * watch if there is none. Must be called with the lock held.
+ */
+DirCache::listing_map_t::iterator DirCache::prepare(
+        const std::string& dirname) {
+    listing_map_t::iterator it = listings.find(dirname);
+    if (it != listings.end()) {
+        return it;
+    }
+
+    lru.push_front(dirname);
+    Listing& listing = listings[dirname];
+    listing.valid = false;
+    listing.wd = add_watch(dirname);
+    listing.serial = 0;
+    listing.mtime = 0;
+    listing.list_time = 0;
+    listing.lru_pos = lru.begin();
+
+    evict();
+
+    return listings.find(dirname);
+}
+
+/*
+ * Remove least recently used listings, and their watches, until the
+ * number of listings is within the limit. Must be called with the lock
+ * held.
+ */
+void DirCache::evict() {
+    while (listings.size() > params.dircache && !lru.empty()) {
+        forget(listings.find(lru.back()));
+    }
+}
+
+/* Remove a listing and its watch. Must be called with the lock held. */
+void DirCache::forget(listing_map_t::iterator it) {
+#ifdef HAVE_SYS_INOTIFY_H
+    if (it->second.wd != -1) {
+        inotify_rm_watch(inotify_fd, it->second.wd);
+        watches.erase(it->second.wd);
+        errno = 0;
+    }
+#endif
+    lru.erase(it->second.lru_pos);
+    listings.erase(it);
+}
+
+/*
+ * Watch a directory for entries being added, removed or renamed. Returns
+ * the watch descriptor, or -1 if the listing must be checked by
+ * modification time instead. Must be called with the lock held.
+ */
+int DirCache::add_watch(const std::string& dirname) {
+#ifdef HAVE_SYS_INOTIFY_H
+    if (!inotify_started) {
+        inotify_started = true;
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd == -1) {
+            mp3fs_info("Cannot use inotify, directory changes will be "
+                       "found by modification time: %s", strerror(errno));
+            errno = 0;
+        }
+    }
+    if (inotify_fd == -1) {
+        return -1;
+    }
+
+    int wd = inotify_add_watch(inotify_fd, dirname.c_str(),
+                               IN_CREATE | IN_DELETE | IN_MOVED_FROM
+                               | IN_MOVED_TO | IN_CLOSE_WRITE
+                               | IN_DELETE_SELF | IN_MOVE_SELF
+                               | IN_ONLYDIR);
+    if (wd == -1) {
+        mp3fs_debug("Cannot watch %s: %s", dirname.c_str(), strerror(errno));
+        errno = 0;
+        return -1;
+    }
+
+    std::map<int,std::string>::iterator watch = watches.find(wd);
+    if (watch == watches.end()) {
+        watches[wd] = dirname;
+    } else if (watch->second != dirname) {
+        /*
+         * The same directory is cached under another path, and that
+         * listing owns the watch.
+         */
+        return -1;
+    }
+
+    return wd;
+#else
+    (void)dirname;
+    return -1;
+#endif
+}
+
+/*
+ * Read any pending inotify events without blocking, and invalidate the
+ * affected listings. New source files are passed to the CacheFiller. Must
+ * be called with the lock held.
+ */
+void DirCache::drain_events() {
+#ifdef HAVE_SYS_INOTIFY_H
+    if (inotify_fd == -1) {
+        return;
+    }
+
+    char data[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(inotify_fd, data, sizeof(data))) > 0) {
+        const char* ptr = data;
+        while (ptr < data + len) {
+            const struct inotify_event* event
+                = (const struct inotify_event*)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                /* Events were lost, so nothing can be trusted. */
+                for (listing_map_t::iterator it = listings.begin();
+                     it != listings.end(); ++it) {
+                    invalidate(it->second);
+                }
+                continue;
+            }
+
+            std::map<int,std::string>::iterator watch
+                = watches.find(event->wd);
+            if (watch == watches.end()) {
+                continue;
+            }
+            std::string dirname = watch->second;
+            listing_map_t::iterator it = listings.find(dirname);
+
+            if (event->mask & IN_IGNORED) {
+                /* The kernel has removed the watch. */
+                watches.erase(watch);
+                if (it != listings.end()) {
+                    it->second.wd = -1;
+                    forget(it);
+                }
+            } else if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                /*
+                 * The watch follows the directory, not its path, so it
+                 * is no use for anything now found under that path.
+                 */
+                if (it != listings.end()) {
+                    forget(it);
+                }
+            } else {
+                /*
+                 * Writing a file does not change the listing, but new
+                 * source files are worth storing ahead of time once they
+                 * are complete: when closed after writing, or when moved
+                 * into place. They are not yet complete when created.
+                 */
+                if (!(event->mask & IN_CLOSE_WRITE) && it != listings.end()) {
+                    invalidate(it->second);
+                }
+                if (event->mask & IN_ISDIR && event->len > 0) {
+                    forget_tree(dirname, event->name);
+                } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)
+                           && event->len > 0) {
+                    const char* ext = strrchr(event->name, '.');
+                    if (ext && decoder_index(ext + 1) != -1) {
+                        CacheFiller::add(dirname + "/" + event->name);
+                    }
+                }
+            }
+        }
+    }
+
+    /* EAGAIN once all events have been read. */
+    errno = 0;
+#endif
+}
+
+/*
+ * Remove the listings of a subdirectory which was removed or renamed, and
+ * of everything below it, as watches on those directories no longer
+ * correspond to their old paths. Must be called with the lock held.
+ */
+void DirCache::forget_tree(const std::string& dirname, const char* name) {
+    std::string prefix = dirname;
+    if (prefix.empty() || prefix[prefix.size() - 1] != '/') {
+        prefix += '/';
+    }
+    prefix += name;
+
+    listing_map_t::iterator it = listings.lower_bound(prefix);
+    while (it != listings.end()
+           && it->first.compare(0, prefix.size(), prefix) == 0) {
+        listing_map_t::iterator next = it;
+        ++next;
+        if (it->first.size() == prefix.size()
+            || it->first[prefix.size()] == '/') {
+            forget(it);
+        }
+        it = next;
+    }
+}
+
+/*
+ * Mark a listing as out of date. Readers which started before this will
+ * not store what they read. Must be called with the lock held.
+ */
+void DirCache::invalidate(Listing& listing) {
+    std::vector<Entry>().swap(listing.entries);
+    name_map_t().swap(listing.names);
+    listing.valid = false;
+    ++listing.serial;
+}
+
+/* Use "C" linkage to allow access from C code. */
+extern "C" {
+
+/* Fill a directory listing for readdir, through the cache. */
+int dircache_readdir(const char* dirname, void* buf,
+                     dircache_filler_t filler) {
+    return DirCache::readdir(normalize(dirname), buf, filler);
+}
+
+/*
+ * Replace the name of a translated file with the name of its source, if
+ * the cached listing of its directory has it. The path must be large
+ * enough to hold the new name. Returns 1 if the name was replaced, 0 if
+ * the listing shows there is no source file, or -1 if there is no
+ * listing.
+ */
+int dircache_find_original(char* path) {
+    std::string dirname, name, original;
+    if (!split(path, dirname, name)) {
+        return -1;
+    }
+
+    int ret = DirCache::find_original(dirname, name, original);
+    if (ret == 1) {
+        strcpy(strrchr(path, '/') + 1, original.c_str());
+    }
+    return ret;
+}
+
+/* Check whether a file is known not to exist. Does not change errno. */
+int dircache_absent(const char* path) {
+    int saved_errno = errno;
+    std::string dirname, name;
+    bool ret = split(path, dirname, name) && DirCache::absent(dirname, name);
+    errno = saved_errno;
+    return ret;
+}
+
+/*
+ * Remember that a file was found not to exist by a lookup started at the
+ * given time. Does not change errno.
+ */
+void dircache_add_absent(const char* path, time_t since) {
+    int saved_errno = errno;
+    std::string dirname, name;
+    if (split(path, dirname, name)) {
+        DirCache::add_absent(dirname, name, since);
+    }
+    errno = saved_errno;
+}
+
+}
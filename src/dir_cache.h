@@ -0,0 +1,99 @@
+/*
+ * Directory listing cache header for mp3fs
+ *
+ * Copyright (C) 2013 Kristofer Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef DIR_CACHE_H
+#define DIR_CACHE_H
+
+#include <sys/stat.h>
+#include <time.h>
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "transcode.h"
+
+/*
+ * Cache of translated source directory listings. Listings are invalidated
+ * by inotify watches on the source directories where available, and
+ * otherwise by comparing the modification time of the directory. A fixed
+ * number of listings are kept, least recently used first out. Each
+ * listing also maps translated names back to their source names. Files
+ * looked up and found not to exist in directories without a listing are
+ * also remembered, until their directory is modified.
+ */
+class DirCache {
+public:
+    static int readdir(const std::string& dirname, void* buf,
+                       dircache_filler_t filler);
+    static int find_original(const std::string& dirname,
+                             const std::string& name, std::string& original);
+    static bool absent(const std::string& dirname, const std::string& name);
+    static void add_absent(const std::string& dirname,
+                           const std::string& name, time_t since);
+private:
+    struct Entry {
+        std::string name;
+        mode_t mode;
+        ino_t ino;
+    };
+    typedef std::map<std::string,std::string> name_map_t;
+    struct Listing {
+        std::vector<Entry> entries;
+        name_map_t names;
+        bool valid;
+        int wd;
+        unsigned long serial;
+        time_t mtime;
+        time_t list_time;
+        std::list<std::string>::iterator lru_pos;
+    };
+    typedef std::map<std::string,Listing> listing_map_t;
+    struct Absent {
+        time_t mtime;
+        std::list<std::string>::iterator lru_pos;
+    };
+    typedef std::map<std::string,Absent> absent_map_t;
+
+    static int read_listing(const std::string& dirname,
+                            std::vector<Entry>& entries,
+                            name_map_t& names);
+    static bool current(const std::string& dirname,
+                        listing_map_t::iterator& it);
+    static void fill(const std::vector<Entry>& entries, void* buf,
+                     dircache_filler_t filler);
+    static listing_map_t::iterator prepare(const std::string& dirname);
+    static void evict();
+    static void forget(listing_map_t::iterator it);
+    static void forget_tree(const std::string& dirname, const char* name);
+    static int add_watch(const std::string& dirname);
+    static void drain_events();
+    static void invalidate(Listing& listing);
+
+    static listing_map_t listings;
+    static std::map<int,std::string> watches;
+    static std::list<std::string> lru;
+    static absent_map_t absents;
+    static std::list<std::string> absent_lru;
+    static int inotify_fd;
+};
+
+#endif
@@ -20,13 +20,130 @@
 
 #include "flac_decoder.h"
 
-#include <algorithm>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
 
 #include "transcode.h"
 
 namespace {
     /* Define invalid value for gain in decibels, to be used later. */
     const double INVALID_DB_GAIN = 1000.0;
+
+    /*
+     * Vorbis comments which are not copied to tags but used by the
+     * decoder itself. These follow the METATAG_ values in coders.h.
+     */
+    enum {
+        METATAG_REPLAYGAIN_REFERENCE_LOUDNESS = NUMBER_METATAG_FIELDS,
+        METATAG_REPLAYGAIN_ALBUM_GAIN,
+        METATAG_REPLAYGAIN_TRACK_GAIN
+    };
+
+    /*
+     * Map from FLAC vorbis comment names to the standard values in the
+     * enum in coders.h. This table must be kept sorted by name, in
+     * uppercase, for the binary search in find_metatag().
+     */
+    const struct {
+        const char* name;
+        int tag;
+    } metatag_table[] = {
+        { "ALBUM",                         METATAG_ALBUM },
+        { "ALBUM ARTIST",                  METATAG_ALBUMARTIST },
+        { "ALBUMARTIST",                   METATAG_ALBUMARTIST },
+        { "ARTIST",                        METATAG_ARTIST },
+        { "COMPOSER",                      METATAG_COMPOSER },
+        { "CONDUCTOR",                     METATAG_CONDUCTOR },
+        { "COPYRIGHT",                     METATAG_COPYRIGHT },
+        { "DATE",                          METATAG_DATE },
+        { "DISCNUMBER",                    METATAG_DISCNUMBER },
+        { "DISCTOTAL",                     METATAG_DISCTOTAL },
+        { "ENCODED_BY",                    METATAG_ENCODEDBY },
+        { "GENRE",                         METATAG_GENRE },
+        { "ORGANIZATION",                  METATAG_ORGANIZATION },
+        { "PERFORMER",                     METATAG_PERFORMER },
+        { "REPLAYGAIN_ALBUM_GAIN",         METATAG_REPLAYGAIN_ALBUM_GAIN },
+        { "REPLAYGAIN_REFERENCE_LOUDNESS", METATAG_REPLAYGAIN_REFERENCE_LOUDNESS },
+        { "REPLAYGAIN_TRACK_GAIN",         METATAG_REPLAYGAIN_TRACK_GAIN },
+        { "TITLE",                         METATAG_TITLE },
+        { "TRACKNUMBER",                   METATAG_TRACKNUMBER },
+        { "TRACKTOTAL",                    METATAG_TRACKTOTAL },
+    };
+
+    const size_t metatag_table_size =
+        sizeof(metatag_table) / sizeof(metatag_table[0]);
+
+    /*
+     * Compare an uppercase, NUL-terminated table name with a field name of
+     * the given length, ignoring the case of the field name. Vorbis
+     * comment field names are plain ASCII, so no locale is involved.
+     */
+    int compare_field_name(const char* table_name, const char* name,
+                           size_t length) {
+        for (size_t i=0; i<length; ++i) {
+            if (table_name[i] == '\0') {
+                return -1;
+            }
+            char c = name[i];
+            if (c >= 'a' && c <= 'z') {
+                c = (char)(c - 'a' + 'A');
+            }
+            if (table_name[i] != c) {
+                return (unsigned char)table_name[i] - (unsigned char)c;
+            }
+        }
+        return (unsigned char)table_name[length];
+    }
+
+    /* Protects the pool of released decoders. */
+    pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+}
+
+std::vector<FlacDecoder*> FlacDecoder::pool;
+
+/*
+ * Get a decoder, reusing one released after an earlier file if there is
+ * one. A reused decoder keeps what libFLAC allocated for the decoder
+ * itself, and only the stream is set up again by open_file().
+ */
+FlacDecoder* FlacDecoder::create() {
+    pthread_mutex_lock(&pool_lock);
+    if (!pool.empty()) {
+        FlacDecoder* decoder = pool.back();
+        pool.pop_back();
+        pthread_mutex_unlock(&pool_lock);
+        return decoder;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    return new FlacDecoder();
+}
+
+/*
+ * Finish decoding, which closes the file and returns libFLAC to its
+ * defaults, and keep the decoder for another file. Only as many are kept
+ * as there are processors, which is about how many files are decoded at
+ * once; the most recently used are handed out first.
+ */
+void FlacDecoder::release() {
+    finish();
+    encoder_c = NULL;
+    buffer_c = NULL;
+
+    long max_pooled = sysconf(_SC_NPROCESSORS_ONLN);
+
+    pthread_mutex_lock(&pool_lock);
+    if ((long)pool.size() < max_pooled) {
+        pool.push_back(this);
+        pthread_mutex_unlock(&pool_lock);
+        return;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    delete this;
 }
 
 /*
@@ -39,7 +156,10 @@ int FlacDecoder::open_file(const char* filename) {
      * initialized.
      */
     set_metadata_respond(FLAC__METADATA_TYPE_VORBIS_COMMENT);
-    set_metadata_respond(FLAC__METADATA_TYPE_PICTURE);
+    if (params.maxpics != 0) {
+        set_metadata_respond(FLAC__METADATA_TYPE_PICTURE);
+    }
+    pictures = 0;
 
     mp3fs_debug("FLAC ready to initialize.");
 
@@ -119,30 +239,41 @@ void FlacDecoder::metadata_callback(const FLAC__StreamMetadata* metadata) {
         }
         case FLAC__METADATA_TYPE_VORBIS_COMMENT:
         {
-            const FLAC::Metadata::VorbisComment vc(metadata);
+            const FLAC__StreamMetadata_VorbisComment& vc =
+                metadata->data.vorbis_comment;
             double filegainref = 89.0;
             double dbgain = INVALID_DB_GAIN;
 
             mp3fs_debug("FLAC processing VORBIS_COMMENT");
 
-            for (unsigned int i=0; i<vc.get_num_comments(); ++i) {
-                const FLAC::Metadata::VorbisComment::Entry comment = vc.get_comment(i);
-                std::string fname(comment.get_field_name());
-                /* Normalize tag name to uppercase. */
-                std::transform(fname.begin(), fname.end(), fname.begin(), ::toupper);
-
-                meta_map_t::const_iterator it = metatag_map.find(fname);
-                if (it != metatag_map.end()) {
-                    encoder_c->set_text_tag(it->second, comment.get_field_value());
-                } else if (fname == "REPLAYGAIN_REFERENCE_LOUDNESS") {
-                    filegainref = atof(comment.get_field_value());
+            /*
+             * Work on the raw comment entries, which have the form
+             * NAME=value. libFLAC always NUL-terminates them, so the value
+             * can be used directly as a C string.
+             */
+            for (FLAC__uint32 i=0; i<vc.num_comments; ++i) {
+                const char* entry = (const char*)vc.comments[i].entry;
+                const char* equals =
+                    (const char*)memchr(entry, '=', vc.comments[i].length);
+                if (!equals) {
+                    continue;
+                }
+                const char* value = equals + 1;
+
+                int tag = find_metatag(entry, equals - entry);
+                if (tag == -1) {
+                    continue;
+                } else if (tag < NUMBER_METATAG_FIELDS) {
+                    encoder_c->set_text_tag(tag, value);
+                } else if (tag == METATAG_REPLAYGAIN_REFERENCE_LOUDNESS) {
+                    filegainref = atof(value);
                 } else if (params.gainmode == 1
-                           && fname == "REPLAYGAIN_ALBUM_GAIN") {
-                    dbgain = atof(comment.get_field_value());
+                           && tag == METATAG_REPLAYGAIN_ALBUM_GAIN) {
+                    dbgain = atof(value);
                 } else if ((params.gainmode == 1 || params.gainmode == 2)
                            && dbgain == INVALID_DB_GAIN
-                           && fname == "REPLAYGAIN_TRACK_GAIN") {
-                    dbgain = atof(comment.get_field_value());
+                           && tag == METATAG_REPLAYGAIN_TRACK_GAIN) {
+                    dbgain = atof(value);
                 }
             }
 
@@ -159,16 +290,38 @@ void FlacDecoder::metadata_callback(const FLAC__StreamMetadata* metadata) {
         }
         case FLAC__METADATA_TYPE_PICTURE:
         {
-            /* add a picture tag for each picture block */
-            const FLAC::Metadata::Picture picture(metadata);
+            /*
+             * Add a picture tag for each picture block, unless it is
+             * excluded by the picture options. Use the block directly,
+             * as the FLAC++ wrapper would copy the picture data.
+             */
+            const FLAC__StreamMetadata_Picture& picture =
+                metadata->data.picture;
 
             mp3fs_debug("FLAC processing PICTURE");
 
-            encoder_c->set_picture_tag(picture.get_mime_type(),
-                                       picture.get_type(),
-                                       (char*)picture.get_description(),
-                                       picture.get_data(),
-                                       picture.get_data_length());
+            if (params.frontcover && picture.type
+                != FLAC__STREAM_METADATA_PICTURE_TYPE_FRONT_COVER) {
+                mp3fs_debug("Skipping picture which is not a front cover.");
+                break;
+            }
+            if (params.maxpicsize && picture.data_length > params.maxpicsize) {
+                mp3fs_debug("Skipping picture of %u bytes.",
+                            (unsigned int)picture.data_length);
+                break;
+            }
+            if (params.maxpics >= 0 && pictures >= params.maxpics) {
+                mp3fs_debug("Skipping picture beyond the first %d.",
+                            params.maxpics);
+                break;
+            }
+            ++pictures;
+
+            encoder_c->set_picture_tag(picture.mime_type,
+                                       picture.type,
+                                       (char*)picture.description,
+                                       picture.data,
+                                       picture.data_length);
 
             break;
         }
@@ -201,33 +354,25 @@ void FlacDecoder::error_callback(FLAC__StreamDecoderErrorStatus status) {
 }
 
 /*
- * This function creates the metadata tag map from FLAC values to the standard
- * values in the enum in coders.h. It will be called only once to set the
- * metatag_map static variable.
+ * Find the metadata tag value for a vorbis comment field name of the given
+ * length, which need not be NUL-terminated. Case is ignored. Returns -1
+ * if the field is not one we handle. This does not allocate, which
+ * matters for files with very many comments.
  */
-const FlacDecoder::meta_map_t FlacDecoder::create_meta_map() {
-    meta_map_t m;
-
-    m["TITLE"] = METATAG_TITLE;
-    m["ARTIST"] = METATAG_ARTIST;
-    m["ALBUM"] = METATAG_ALBUM;
-    m["GENRE"] = METATAG_GENRE;
-    m["DATE"] = METATAG_DATE;
-    m["COMPOSER"] = METATAG_COMPOSER;
-    m["PERFORMER"] = METATAG_PERFORMER;
-    m["COPYRIGHT"] = METATAG_COPYRIGHT;
-    m["ENCODED_BY"] = METATAG_ENCODEDBY;
-    m["ORGANIZATION"] = METATAG_ORGANIZATION;
-    m["CONDUCTOR"] = METATAG_CONDUCTOR;
-    m["ALBUMARTIST"] = METATAG_ALBUMARTIST;
-    m["ALBUM ARTIST"] = METATAG_ALBUMARTIST;
-    m["TRACKNUMBER"] = METATAG_TRACKNUMBER;
-    m["TRACKTOTAL"] = METATAG_TRACKTOTAL;
-    m["DISCNUMBER"] = METATAG_DISCNUMBER;
-    m["DISCTOTAL"] = METATAG_DISCTOTAL;
-
-    return m;
-}
+int FlacDecoder::find_metatag(const char* name, size_t length) {
+    size_t low = 0, high = metatag_table_size;
+
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        int cmp = compare_field_name(metatag_table[mid].name, name, length);
+        if (cmp == 0) {
+            return metatag_table[mid].tag;
+        } else if (cmp < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
 
-const FlacDecoder::meta_map_t FlacDecoder::metatag_map
-    = FlacDecoder::create_meta_map();
+    return -1;
+}
@@ -23,8 +23,9 @@
 
 #include "coders.h"
 
-#include <map>
-#include <string>
+#include <stddef.h>
+
+#include <vector>
 
 #include <FLAC++/decoder.h>
 #include <FLAC++/metadata.h>
@@ -34,6 +35,9 @@ public:
     int open_file(const char* filename);
     int process_metadata(Encoder* encoder);
     int process_single_fr(Encoder* encoder, Buffer* buffer);
+    void release();
+
+    static FlacDecoder* create();
 protected:
     FLAC__StreamDecoderWriteStatus write_callback(const FLAC__Frame* frame,
                                                   const FLAC__int32* const buffer[]);
@@ -42,10 +46,11 @@ protected:
 private:
     Encoder* encoder_c;
     Buffer* buffer_c;
+    int pictures;
     FLAC::Metadata::StreamInfo info;
-    typedef std::map<std::string,int> meta_map_t;
-    static const meta_map_t create_meta_map();
-    static const meta_map_t metatag_map;
+    static int find_metatag(const char* name, size_t length);
+
+    static std::vector<FlacDecoder*> pool;
 };
 
 
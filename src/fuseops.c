@@ -27,6 +27,7 @@
 #include <errno.h>
 #include <dirent.h>
 #include <limits.h>
+#include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
 
@@ -69,11 +70,16 @@ void transcoded_name(char* path) {
  * Given the destination (post-transcode) file name, determine the name of
  * the original file to be transcoded. The new extension will be copied in
  * place, and the passed path must be large enough to hold the new name.
+ * The cached listing of the directory is used if there is one. Otherwise,
+ * each decoder extension is tried in the order of decoder_list.
  */
 void find_original(char* path) {
     char* ext = strrchr(path, '.');
 
     if (ext && strcmp(ext + 1, params.desttype) == 0) {
+        if (dircache_find_original(path) != -1) {
+            return;
+        }
         for (size_t i=0; i<sizeof_decoder_list; ++i) {
             strcpy(ext + 1, decoder_list[i]);
             if (access(path, F_OK) == 0) {
@@ -119,14 +125,35 @@ translate_fail:
     return -errno;
 }
 
+/* FUSE filler function and buffer, passed through the directory cache. */
+struct readdir_state {
+    void* buf;
+    fuse_fill_dir_t filler;
+};
+
+static int fill_dir_entry(void* buf, const char* name,
+                          const struct stat* st) {
+    struct readdir_state* state = buf;
+#if FUSE_USE_VERSION >= 30
+    return state->filler(state->buf, name, st, 0, 0);
+#else
+    return state->filler(state->buf, name, st, 0);
+#endif
+}
+
+#if FUSE_USE_VERSION >= 30
+static int mp3fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                         off_t offset, struct fuse_file_info *fi,
+                         enum fuse_readdir_flags flags) {
+    (void)flags;
+#else
 static int mp3fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                          off_t offset, struct fuse_file_info *fi) {
+#endif
     (void)offset;
     (void)fi;
+    struct readdir_state state = { buf, filler };
     char* origpath;
-    char* origfile;
-    DIR *dp;
-    struct dirent *de;
     
     mp3fs_debug("readdir %s", path);
     
@@ -137,48 +164,23 @@ static int mp3fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         goto translate_fail;
     }
     
-    /* 2 for directory separator and NULL byte */
-    origfile = malloc(strlen(origpath) + NAME_MAX + 2);
-    if (!origfile) {
-        goto origfile_fail;
-    }
-    
-    dp = opendir(origpath);
-    if (!dp) {
-        goto opendir_fail;
-    }
+    dircache_readdir(origpath, &state, fill_dir_entry);
     
-    while ((de = readdir(dp))) {
-        struct stat st;
-        
-        snprintf(origfile, strlen(origpath) + NAME_MAX + 2, "%s/%s", origpath,
-                 de->d_name);
-        
-        if (lstat(origfile, &st) == -1) {
-            goto stat_fail;
-        } else {
-            if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode)) {
-                // TODO: Make this safe if converting from short to long ext.
-                transcoded_name(de->d_name);
-            }
-        }
-        
-        if (filler(buf, de->d_name, &st, 0)) break;
-    }
-    
-stat_fail:
-    closedir(dp);
-opendir_fail:
-    free(origfile);
-origfile_fail:
     free(origpath);
 translate_fail:
     return -errno;
 }
 
+#if FUSE_USE_VERSION >= 30
+static int mp3fs_getattr(const char *path, struct stat *stbuf,
+                         struct fuse_file_info *fi) {
+    (void)fi;
+#else
 static int mp3fs_getattr(const char *path, struct stat *stbuf) {
+#endif
     char* origpath;
     struct transcoder* trans;
+    time_t start = time(NULL);
     
     mp3fs_debug("getattr %s", path);
     
@@ -189,6 +191,12 @@ static int mp3fs_getattr(const char *path, struct stat *stbuf) {
         goto translate_fail;
     }
     
+    /* Answer lookups of files known not to exist without searching. */
+    if (dircache_absent(origpath)) {
+        errno = ENOENT;
+        goto stat_fail;
+    }
+    
     /* pass-through for regular files */
     if (lstat(origpath, stbuf) == 0) {
         goto passthrough;
@@ -200,6 +208,11 @@ static int mp3fs_getattr(const char *path, struct stat *stbuf) {
     find_original(origpath);
     
     if (lstat(origpath, stbuf) == -1) {
+        /* Remember the file as missing if no source name was found. */
+        if (errno == ENOENT
+            && strcmp(origpath + strlen(params.basepath), path) == 0) {
+            dircache_add_absent(origpath, start);
+        }
         goto stat_fail;
     }
     
@@ -259,7 +272,7 @@ static int mp3fs_open(const char *path, struct fuse_file_info *fi) {
     
     find_original(origpath);
     
-    trans = transcoder_new(origpath);
+    trans = transcoder_open(origpath, fuse_get_context()->pid);
     if (!trans) {
         goto transcoder_fail;
     }
@@ -273,6 +286,11 @@ static int mp3fs_open(const char *path, struct fuse_file_info *fi) {
         fi->direct_io = 1;
     }
     
+    /* Keep what the kernel cached from earlier opens if it is still good. */
+    if (transcoder_keep_cache(trans)) {
+        fi->keep_cache = 1;
+    }
+    
 transcoder_fail:
 passthrough:
 open_fail:
@@ -332,6 +350,64 @@ translate_fail:
     }
 }
 
+#if FUSE_VERSION >= 29
+/*
+ * Once a transcoded file is finished, hand FUSE the descriptor holding it
+ * so that the data can be spliced to the kernel instead of copied.
+ * Anything else goes through mp3fs_read.
+ */
+static int mp3fs_read_buf(const char *path, struct fuse_bufvec **bufp,
+                          size_t size, off_t offset,
+                          struct fuse_file_info *fi) {
+    struct transcoder* trans = (struct transcoder*)fi->fh;
+    struct fuse_bufvec* bufv;
+    int fd;
+    size_t filesize;
+    int ret;
+    
+    bufv = malloc(sizeof(struct fuse_bufvec));
+    if (!bufv) {
+        return -ENOMEM;
+    }
+    *bufv = FUSE_BUFVEC_INIT(size);
+    
+    fd = trans ? transcoder_fd(trans) : -1;
+    if (fd != -1) {
+        mp3fs_debug("read %s: %zu bytes from %jd", path, size,
+                    (intmax_t)offset);
+        filesize = transcoder_get_size(trans);
+        if ((size_t)offset >= filesize) {
+            bufv->buf[0].size = 0;
+        } else if (offset + size > filesize) {
+            bufv->buf[0].size = filesize - offset;
+        }
+        bufv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        bufv->buf[0].fd = fd;
+        bufv->buf[0].pos = offset;
+        *bufp = bufv;
+        transcoder_fd_read(trans, offset, bufv->buf[0].size);
+        return 0;
+    }
+    
+    bufv->buf[0].mem = malloc(size);
+    if (!bufv->buf[0].mem) {
+        free(bufv);
+        return -ENOMEM;
+    }
+    
+    ret = mp3fs_read(path, bufv->buf[0].mem, size, offset, fi);
+    if (ret < 0) {
+        free(bufv->buf[0].mem);
+        free(bufv);
+        return ret;
+    }
+    bufv->buf[0].size = (size_t)ret;
+    *bufp = bufv;
+    
+    return 0;
+}
+#endif
+
 static int mp3fs_statfs(const char *path, struct statvfs *stbuf) {
     char* origpath;
     
@@ -365,12 +441,54 @@ static int mp3fs_release(const char *path, struct fuse_file_info *fi) {
     return 0;
 }
 
-/* We need synchronous reads. */
-static void *mp3fs_init(struct fuse_conn_info *conn) {
+/*
+ * Set up the connection to the kernel, for either API. We need synchronous
+ * reads. Data can be moved with splice where the kernel allows, and as
+ * nothing is written, no write caching is asked for. This runs once the
+ * process is in the background, so threads are started here.
+ */
+void mp3fs_conn_init(struct fuse_conn_info *conn) {
+#if FUSE_USE_VERSION >= 30
+    conn->want &= ~FUSE_CAP_ASYNC_READ;
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE
+                                   | FUSE_CAP_SPLICE_MOVE
+                                   | FUSE_CAP_PARALLEL_DIROPS);
+    conn->want &= ~FUSE_CAP_WRITEBACK_CACHE;
+    
+    mp3fs_debug("FUSE connection: max_read %u, max_write %u", conn->max_read,
+                conn->max_write);
+#else
     conn->async_read = 0;
+#if FUSE_VERSION >= 29
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE
+                                   | FUSE_CAP_SPLICE_MOVE);
+#endif
+#endif
+    
+    mp3fs_debug("FUSE connection: protocol %u.%u, max_readahead %u",
+                conn->proto_major, conn->proto_minor, conn->max_readahead);
+    
+    cachefill_start();
+}
+
+#if FUSE_USE_VERSION >= 30
+static void *mp3fs_init(struct fuse_conn_info *conn,
+                        struct fuse_config *cfg) {
+    mp3fs_conn_init(conn);
+    
+    cfg->attr_timeout = params.attr_timeout;
+    cfg->entry_timeout = params.entry_timeout;
+    cfg->negative_timeout = params.negative_timeout;
+    
+    return NULL;
+}
+#else
+static void *mp3fs_init(struct fuse_conn_info *conn) {
+    mp3fs_conn_init(conn);
     
     return NULL;
 }
+#endif
 
 struct fuse_operations mp3fs_ops = {
     .getattr  = mp3fs_getattr,
@@ -378,6 +496,9 @@ struct fuse_operations mp3fs_ops = {
     .readdir  = mp3fs_readdir,
     .open     = mp3fs_open,
     .read     = mp3fs_read,
+#if FUSE_VERSION >= 29
+    .read_buf = mp3fs_read_buf,
+#endif
     .statfs   = mp3fs_statfs,
     .release  = mp3fs_release,
     .init     = mp3fs_init,
@@ -0,0 +1,1089 @@
+/*
+ * MP3FS: A read-only FUSE filesystem which transcodes audio formats
+ * (currently FLAC) to MP3 on the fly when opened and read. This file
+ * implements the filesystem using the FUSE low-level API. Each inode
+ * refers to a file by name relative to its parent directory, and recently
+ * used directories are kept open, so lookups rarely rebuild paths.
+ *
+ * Copyright (C) 2013 Kristofer Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "transcode.h"
+
+#include <fuse_lowlevel.h>
+
+/*
+ * An inode known to the kernel. Files are identified by source device and
+ * inode number, and by whether they are transcoded, since a source file
+ * can be looked up under both its own name and the translated one.
+ */
+struct node {
+    struct node* next;
+    struct node* parent;
+    dev_t dev;
+    ino_t ino;
+    int translated;
+    /* Lookups by the kernel, plus one for each child. */
+    unsigned long refs;
+    /* Directory descriptor, or -1 if not open or for other files. */
+    int fd;
+    /* Users of the descriptor, and its place among the open ones. */
+    unsigned int fd_users;
+    struct node* fd_prev;
+    struct node* fd_next;
+    /* Source modification time when last examined. */
+    time_t mtime;
+    /* Source name in the parent directory, and full source path. */
+    char* name;
+    char* path;
+};
+
+/* Directory listing made on opendir, served in pieces by readdir. */
+struct dir_handle {
+    struct dir_entry {
+        char* name;
+        mode_t mode;
+        ino_t ino;
+    }* entries;
+    size_t count;
+    size_t alloc;
+};
+
+/* Open file: either a source file read directly, or a transcoder. */
+struct file_handle {
+    int fd;
+    struct transcoder* trans;
+};
+
+static struct node root;
+static struct node** node_table;
+static size_t node_buckets;
+static size_t node_count;
+static pthread_mutex_t node_lock = PTHREAD_MUTEX_INITIALIZER;
+#if FUSE_USE_VERSION >= 30
+static struct fuse_session* ll_session;
+#else
+static struct fuse_chan* ll_chan;
+#endif
+
+/*
+ * Directories are opened when first used rather than kept open for as
+ * long as the kernel knows them, and beyond this many the least recently
+ * used are closed again, so large trees do not run out of descriptors.
+ */
+#define MAX_OPEN_DIRS 256
+
+/* Open directory descriptors, most recently used first. */
+static struct node* open_dirs_head;
+static struct node* open_dirs_tail;
+static size_t open_dirs;
+
+#if FUSE_USE_VERSION >= 30 || FUSE_VERSION >= 28
+/*
+ * Inodes whose cached data is to be invalidated. Invalidating from within
+ * a request can deadlock, as the kernel may wait for a read which needs a
+ * free worker thread, so it is done by a thread of its own.
+ */
+struct inval {
+    struct inval* next;
+    fuse_ino_t ino;
+};
+
+static struct inval* inval_queue;
+static pthread_mutex_t inval_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inval_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t inval_thread;
+static int inval_started;
+static int inval_stop;
+#endif
+
+static struct node* get_node(fuse_ino_t ino) {
+    return ino == FUSE_ROOT_ID ? &root : (struct node*)(uintptr_t)ino;
+}
+
+static size_t node_hash(dev_t dev, ino_t ino, int translated) {
+    return ((size_t)ino * 31 + (size_t)dev) * 2 + (size_t)translated;
+}
+
+/* Double the number of hash buckets. Must be called with the lock held. */
+static int grow_table(void) {
+    size_t buckets = node_buckets ? node_buckets * 2 : 1024;
+    struct node** table = calloc(buckets, sizeof(struct node*));
+    if (!table) {
+        return -1;
+    }
+
+    for (size_t i=0; i<node_buckets; ++i) {
+        struct node* node = node_table[i];
+        while (node) {
+            struct node* next = node->next;
+            size_t b = node_hash(node->dev, node->ino, node->translated)
+                % buckets;
+            node->next = table[b];
+            table[b] = node;
+            node = next;
+        }
+    }
+
+    free(node_table);
+    node_table = table;
+    node_buckets = buckets;
+    return 0;
+}
+
+/* Remove a node from the list of open directories. Lock must be held. */
+static void unlink_open_dir(struct node* node) {
+    if (node->fd_prev) {
+        node->fd_prev->fd_next = node->fd_next;
+    } else {
+        open_dirs_head = node->fd_next;
+    }
+    if (node->fd_next) {
+        node->fd_next->fd_prev = node->fd_prev;
+    } else {
+        open_dirs_tail = node->fd_prev;
+    }
+    node->fd_prev = NULL;
+    node->fd_next = NULL;
+}
+
+/* Put a node first in the list of open directories. Lock must be held. */
+static void link_open_dir(struct node* node) {
+    node->fd_prev = NULL;
+    node->fd_next = open_dirs_head;
+    if (open_dirs_head) {
+        open_dirs_head->fd_prev = node;
+    } else {
+        open_dirs_tail = node;
+    }
+    open_dirs_head = node;
+}
+
+/*
+ * Close the least recently used directories not in use while more than
+ * MAX_OPEN_DIRS are open. Must be called with the lock held.
+ */
+static void close_open_dirs(void) {
+    struct node* node = open_dirs_tail;
+
+    while (open_dirs > MAX_OPEN_DIRS && node) {
+        struct node* prev = node->fd_prev;
+        if (node->fd_users == 0) {
+            unlink_open_dir(node);
+            close(node->fd);
+            node->fd = -1;
+            --open_dirs;
+        }
+        node = prev;
+    }
+}
+
+/*
+ * Get a descriptor for a directory node, opening the directory if needed.
+ * It stays open until put_dir_fd() is called. Returns -1 with errno set
+ * on failure.
+ */
+static int get_dir_fd(struct node* dir) {
+    int fd = -1;
+    int ret;
+
+    if (dir == &root) {
+        return root.fd;
+    }
+
+    pthread_mutex_lock(&node_lock);
+    if (dir->fd == -1) {
+        pthread_mutex_unlock(&node_lock);
+        fd = open(dir->path, O_RDONLY | O_DIRECTORY);
+        if (fd == -1) {
+            return -1;
+        }
+        pthread_mutex_lock(&node_lock);
+
+        /* Another thread may have opened it meanwhile. */
+        if (dir->fd == -1) {
+            dir->fd = fd;
+            fd = -1;
+            link_open_dir(dir);
+            ++open_dirs;
+        }
+    }
+
+    unlink_open_dir(dir);
+    link_open_dir(dir);
+    ++dir->fd_users;
+    ret = dir->fd;
+    close_open_dirs();
+    pthread_mutex_unlock(&node_lock);
+
+    if (fd != -1) {
+        close(fd);
+    }
+    return ret;
+}
+
+/* Release a descriptor obtained from get_dir_fd(). Does not change errno. */
+static void put_dir_fd(struct node* dir) {
+    int saved_errno = errno;
+
+    if (dir == &root) {
+        return;
+    }
+
+    pthread_mutex_lock(&node_lock);
+    --dir->fd_users;
+    close_open_dirs();
+    pthread_mutex_unlock(&node_lock);
+
+    errno = saved_errno;
+}
+
+/*
+ * Find the node for a file found in a directory, or create it, and count
+ * a lookup of it. Returns NULL with errno set on failure.
+ */
+static struct node* get_child(struct node* parent, const char* name,
+                              const struct stat* st, int translated) {
+    struct node* node;
+
+    pthread_mutex_lock(&node_lock);
+
+    if (node_count >= node_buckets * 2 && grow_table() == -1) {
+        errno = ENOMEM;
+        goto fail;
+    }
+
+    size_t b = node_hash(st->st_dev, st->st_ino, translated) % node_buckets;
+    for (node = node_table[b]; node; node = node->next) {
+        if (node->dev == st->st_dev && node->ino == st->st_ino
+            && node->translated == translated) {
+            ++node->refs;
+            pthread_mutex_unlock(&node_lock);
+            return node;
+        }
+    }
+
+    node = calloc(1, sizeof(struct node));
+    if (!node) {
+        goto fail;
+    }
+    node->name = strdup(name);
+    node->path = malloc(strlen(parent->path) + strlen(name) + 2);
+    if (!node->name || !node->path) {
+        free(node->name);
+        free(node->path);
+        free(node);
+        goto fail;
+    }
+    sprintf(node->path, "%s/%s", parent->path, name);
+    node->parent = parent;
+    node->dev = st->st_dev;
+    node->ino = st->st_ino;
+    node->translated = translated;
+    node->refs = 1;
+    node->fd = -1;
+    node->mtime = st->st_mtime;
+
+    ++parent->refs;
+    node->next = node_table[b];
+    node_table[b] = node;
+    ++node_count;
+
+    pthread_mutex_unlock(&node_lock);
+    return node;
+
+fail:
+    pthread_mutex_unlock(&node_lock);
+    return NULL;
+}
+
+/* Drop references to a node, freeing it and possibly its parents. */
+static void put_node(struct node* node, unsigned long count) {
+    pthread_mutex_lock(&node_lock);
+
+    while (node != &root && (node->refs -= count) == 0) {
+        struct node* parent = node->parent;
+        struct node** link = &node_table[node_hash(node->dev, node->ino,
+                                                   node->translated)
+                                         % node_buckets];
+        while (*link != node) {
+            link = &(*link)->next;
+        }
+        *link = node->next;
+        --node_count;
+
+        if (node->fd != -1) {
+            unlink_open_dir(node);
+            close(node->fd);
+            --open_dirs;
+        }
+        free(node->name);
+        free(node->path);
+        free(node);
+
+        node = parent;
+        count = 1;
+    }
+
+    pthread_mutex_unlock(&node_lock);
+}
+
+#if FUSE_USE_VERSION >= 30 || FUSE_VERSION >= 28
+static void* run_inval(void* arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&inval_lock);
+    while (!inval_stop) {
+        struct inval* item = inval_queue;
+        if (!item) {
+            pthread_cond_wait(&inval_cond, &inval_lock);
+            continue;
+        }
+        inval_queue = item->next;
+        pthread_mutex_unlock(&inval_lock);
+
+#if FUSE_USE_VERSION >= 30
+        fuse_lowlevel_notify_inval_inode(ll_session, item->ino, 0, 0);
+#else
+        fuse_lowlevel_notify_inval_inode(ll_chan, item->ino, 0, 0);
+#endif
+        free(item);
+
+        pthread_mutex_lock(&inval_lock);
+    }
+    pthread_mutex_unlock(&inval_lock);
+
+    return NULL;
+}
+
+/*
+ * Have the kernel's cached data for an inode invalidated once the current
+ * request is answered. If this fails, the data is still dropped by the
+ * next open, which does not keep the cache of a changed file.
+ */
+static void queue_inval(fuse_ino_t ino) {
+    struct inval* item = malloc(sizeof(struct inval));
+    if (!item) {
+        return;
+    }
+    item->ino = ino;
+
+    pthread_mutex_lock(&inval_lock);
+    if (!inval_started) {
+        if (pthread_create(&inval_thread, NULL, run_inval, NULL) != 0) {
+            pthread_mutex_unlock(&inval_lock);
+            free(item);
+            return;
+        }
+        inval_started = 1;
+    }
+    item->next = inval_queue;
+    inval_queue = item;
+    pthread_cond_signal(&inval_cond);
+    pthread_mutex_unlock(&inval_lock);
+}
+
+/* Stop invalidating before the session goes away. */
+static void stop_inval(void) {
+    pthread_mutex_lock(&inval_lock);
+    inval_stop = 1;
+    pthread_cond_signal(&inval_cond);
+    pthread_mutex_unlock(&inval_lock);
+
+    if (inval_started) {
+        pthread_join(inval_thread, NULL);
+    }
+    while (inval_queue) {
+        struct inval* item = inval_queue;
+        inval_queue = item->next;
+        free(item);
+    }
+}
+#else
+static void stop_inval(void) {
+}
+#endif
+
+/*
+ * Get the attributes of a node. Transcoded files get the size of their
+ * output, and cached data for them is invalidated if the source changed
+ * since it was last examined. Returns 0, or -1 with errno set.
+ */
+static int stat_node(fuse_ino_t ino, struct node* node, struct stat* st) {
+    struct transcoder* trans;
+    int dirfd, ret;
+
+    if (node == &root) {
+        ret = fstat(root.fd, st);
+    } else {
+        dirfd = get_dir_fd(node->parent);
+        if (dirfd == -1) {
+            return -1;
+        }
+        ret = fstatat(dirfd, node->name, st, AT_SYMLINK_NOFOLLOW);
+        put_dir_fd(node->parent);
+    }
+    if (ret == -1 || !node->translated || !S_ISREG(st->st_mode)) {
+        return ret;
+    }
+
+    trans = transcoder_new(node->path);
+    if (!trans) {
+        if (!errno) {
+            errno = EIO;
+        }
+        return -1;
+    }
+    st->st_size = transcoder_get_size(trans);
+    st->st_blocks = (st->st_size + 512 - 1) / 512;
+    transcoder_finish(trans);
+    transcoder_delete(trans);
+
+    pthread_mutex_lock(&node_lock);
+    int changed = node->mtime != st->st_mtime;
+    node->mtime = st->st_mtime;
+    pthread_mutex_unlock(&node_lock);
+
+#if FUSE_USE_VERSION >= 30 || FUSE_VERSION >= 28
+    if (changed) {
+        queue_inval(ino);
+    }
+#else
+    (void)changed;
+    (void)ino;
+#endif
+
+    return 0;
+}
+
+/*
+ * Given the destination (post-transcode) file name, find a source file for
+ * it in a directory, trying each decoder extension in the order of
+ * decoder_list. Returns a newly allocated name and fills in its
+ * attributes, or returns NULL.
+ */
+static char* find_source(int dirfd, const char* name, struct stat* st) {
+    const char* ext = strrchr(name, '.');
+    size_t stem;
+    char* source;
+
+    if (!ext || strcmp(ext + 1, params.desttype) != 0) {
+        return NULL;
+    }
+
+    stem = ext + 1 - name;
+    source = malloc(stem + NAME_MAX + 1);
+    if (!source) {
+        return NULL;
+    }
+    memcpy(source, name, stem);
+
+    for (size_t i=0; i<sizeof_decoder_list; ++i) {
+        strcpy(source + stem, decoder_list[i]);
+        if (fstatat(dirfd, source, st, AT_SYMLINK_NOFOLLOW) == 0
+            && (S_ISREG(st->st_mode) || S_ISLNK(st->st_mode))) {
+            return source;
+        }
+    }
+
+    free(source);
+    return NULL;
+}
+
+/*
+ * Look up a name in a directory and fill in its entry, counting a lookup
+ * of its node. A missing file gets a negative entry with no node. Returns
+ * 0, or an error number.
+ */
+static int do_lookup(struct node* dir, const char *name,
+                     struct fuse_entry_param* e) {
+    struct node* node;
+    char* source = NULL;
+    int dirfd, err = 0;
+
+    memset(e, 0, sizeof(*e));
+    e->attr_timeout = params.attr_timeout;
+    e->entry_timeout = params.entry_timeout;
+
+    dirfd = get_dir_fd(dir);
+    if (dirfd == -1) {
+        return errno;
+    }
+
+    /* pass-through for regular files */
+    if (fstatat(dirfd, name, &e->attr, AT_SYMLINK_NOFOLLOW) == -1) {
+        err = errno;
+        if (err == ENOENT) {
+            source = find_source(dirfd, name, &e->attr);
+        }
+    }
+    put_dir_fd(dir);
+
+    if (err && !source) {
+        if (err != ENOENT) {
+            return err;
+        }
+
+        /* Let the kernel remember that the file does not exist. */
+        e->ino = 0;
+        e->entry_timeout = params.negative_timeout;
+        return 0;
+    }
+
+    node = get_child(dir, source ? source : name, &e->attr, source != NULL);
+    free(source);
+    if (!node) {
+        return errno;
+    }
+
+    errno = 0;
+    if (node->translated
+        && stat_node((fuse_ino_t)(uintptr_t)node, node, &e->attr) == -1) {
+        int err = errno ? errno : EIO;
+        put_node(node, 1);
+        return err;
+    }
+
+    e->ino = (fuse_ino_t)(uintptr_t)node;
+    return 0;
+}
+
+static void mp3fs_ll_lookup(fuse_req_t req, fuse_ino_t parent,
+                            const char *name) {
+    struct node* dir = get_node(parent);
+    struct fuse_entry_param e;
+    int err;
+
+    mp3fs_debug("lookup %s/%s", dir->path, name);
+
+    err = do_lookup(dir, name, &e);
+    if (err) {
+        fuse_reply_err(req, err);
+    } else {
+        fuse_reply_entry(req, &e);
+    }
+}
+
+static void mp3fs_ll_forget(fuse_req_t req, fuse_ino_t ino,
+                            unsigned long nlookup) {
+    put_node(get_node(ino), nlookup);
+    fuse_reply_none(req);
+}
+
+#if FUSE_VERSION >= 29
+static void mp3fs_ll_forget_multi(fuse_req_t req, size_t count,
+                                  struct fuse_forget_data *forgets) {
+    for (size_t i=0; i<count; ++i) {
+        put_node(get_node(forgets[i].ino), forgets[i].nlookup);
+    }
+    fuse_reply_none(req);
+}
+#endif
+
+static void mp3fs_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+                             struct fuse_file_info *fi) {
+    (void)fi;
+    struct stat st;
+
+    mp3fs_debug("getattr %s", get_node(ino)->path);
+
+    errno = 0;
+    if (stat_node(ino, get_node(ino), &st) == -1) {
+        fuse_reply_err(req, errno ? errno : EIO);
+        return;
+    }
+
+    fuse_reply_attr(req, &st, params.attr_timeout);
+}
+
+static void mp3fs_ll_readlink(fuse_req_t req, fuse_ino_t ino) {
+    struct node* node = get_node(ino);
+    char buf[PATH_MAX + 1];
+    ssize_t len;
+    int dirfd;
+
+    mp3fs_debug("readlink %s", node->path);
+
+    dirfd = get_dir_fd(node->parent);
+    if (dirfd == -1) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+    len = readlinkat(dirfd, node->name, buf, sizeof(buf) - 2);
+    put_dir_fd(node->parent);
+    if (len == -1) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+
+    buf[len] = '\0';
+
+    transcoded_name(buf);
+
+    fuse_reply_readlink(req, buf);
+}
+
+/* Add an entry to a directory listing being made for opendir. */
+static int add_dir_entry(void* buf, const char* name,
+                         const struct stat* stbuf) {
+    struct dir_handle* dh = buf;
+
+    if (dh->count == dh->alloc) {
+        size_t alloc = dh->alloc ? dh->alloc * 2 : 64;
+        struct dir_entry* entries = realloc(dh->entries,
+                                            alloc * sizeof(*entries));
+        if (!entries) {
+            return 1;
+        }
+        dh->entries = entries;
+        dh->alloc = alloc;
+    }
+
+    struct dir_entry* entry = &dh->entries[dh->count];
+    entry->name = strdup(name);
+    if (!entry->name) {
+        return 1;
+    }
+    entry->mode = stbuf ? stbuf->st_mode : 0;
+    entry->ino = stbuf ? stbuf->st_ino : 0;
+    ++dh->count;
+
+    return 0;
+}
+
+static void free_dir_handle(struct dir_handle* dh) {
+    for (size_t i=0; i<dh->count; ++i) {
+        free(dh->entries[i].name);
+    }
+    free(dh->entries);
+    free(dh);
+}
+
+static void mp3fs_ll_opendir(fuse_req_t req, fuse_ino_t ino,
+                             struct fuse_file_info *fi) {
+    struct node* node = get_node(ino);
+    struct dir_handle* dh;
+
+    mp3fs_debug("opendir %s", node->path);
+
+    dh = calloc(1, sizeof(struct dir_handle));
+    if (!dh) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    /*
+     * The listing is read whole, through the directory cache, so that
+     * offsets stay valid and names are translated the same way as for
+     * the high-level API.
+     */
+    errno = 0;
+    if (dircache_readdir(node->path, dh, add_dir_entry) == -1) {
+        int err = errno;
+        free_dir_handle(dh);
+        fuse_reply_err(req, err);
+        return;
+    }
+
+    fi->fh = (uint64_t)(uintptr_t)dh;
+    fuse_reply_open(req, fi);
+}
+
+static void mp3fs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                             off_t off, struct fuse_file_info *fi) {
+    (void)ino;
+    struct dir_handle* dh = (struct dir_handle*)(uintptr_t)fi->fh;
+    size_t pos = 0;
+    char* buf;
+
+    buf = malloc(size);
+    if (!buf) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    for (size_t i=(size_t)off; i<dh->count; ++i) {
+        struct stat st;
+        size_t len;
+
+        memset(&st, 0, sizeof(st));
+        st.st_ino = dh->entries[i].ino;
+        st.st_mode = dh->entries[i].mode;
+
+        len = fuse_add_direntry(req, buf + pos, size - pos,
+                                dh->entries[i].name, &st, (off_t)(i + 1));
+        if (len > size - pos) {
+            break;
+        }
+        pos += len;
+    }
+
+    fuse_reply_buf(req, buf, pos);
+    free(buf);
+}
+
+#if FUSE_USE_VERSION >= 30
+/*
+ * List a directory with the full attributes of each entry, including the
+ * output size of transcoded files, saving the kernel a lookup of each.
+ */
+static void mp3fs_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+                                 off_t off, struct fuse_file_info *fi) {
+    struct dir_handle* dh = (struct dir_handle*)(uintptr_t)fi->fh;
+    struct node* dir = get_node(ino);
+    size_t pos = 0;
+    char* buf;
+
+    buf = malloc(size);
+    if (!buf) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    for (size_t i=(size_t)off; i<dh->count; ++i) {
+        const char* name = dh->entries[i].name;
+        struct fuse_entry_param e;
+        size_t len;
+
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            memset(&e, 0, sizeof(e));
+            e.attr.st_ino = dh->entries[i].ino;
+            e.attr.st_mode = dh->entries[i].mode;
+        } else if (do_lookup(dir, name, &e) != 0 || e.ino == 0) {
+            /* Entry disappeared since opendir; leave it out. */
+            continue;
+        }
+
+        len = fuse_add_direntry_plus(req, buf + pos, size - pos, name, &e,
+                                     (off_t)(i + 1));
+        if (len > size - pos) {
+            /* Entry does not fit, so the kernel will not see the lookup. */
+            if (e.ino) {
+                put_node(get_node(e.ino), 1);
+            }
+            break;
+        }
+        pos += len;
+    }
+
+    fuse_reply_buf(req, buf, pos);
+    free(buf);
+}
+#endif
+
+static void mp3fs_ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+                                struct fuse_file_info *fi) {
+    (void)ino;
+    free_dir_handle((struct dir_handle*)(uintptr_t)fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+static void mp3fs_ll_open(fuse_req_t req, fuse_ino_t ino,
+                          struct fuse_file_info *fi) {
+    struct node* node = get_node(ino);
+    struct file_handle* fh;
+
+    mp3fs_debug("open %s", node->path);
+
+    fh = malloc(sizeof(struct file_handle));
+    if (!fh) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    fh->fd = -1;
+    fh->trans = NULL;
+
+    errno = 0;
+    if (!node->translated) {
+        int dirfd = get_dir_fd(node->parent);
+        if (dirfd == -1) {
+            goto fail;
+        }
+        fh->fd = openat(dirfd, node->name, fi->flags);
+        put_dir_fd(node->parent);
+        if (fh->fd == -1) {
+            goto fail;
+        }
+    } else {
+        fh->trans = transcoder_open(node->path, fuse_req_ctx(req)->pid);
+        if (!fh->trans) {
+            goto fail;
+        }
+
+        /*
+         * Enable direct I/O to disable page cache if variable bitrate
+         * encoding is enabled, as the size of the file is unknown.
+         */
+        if (params.vbr) {
+            fi->direct_io = 1;
+        }
+
+        /* Keep what the kernel cached from earlier opens if still good. */
+        if (transcoder_keep_cache(fh->trans)) {
+            fi->keep_cache = 1;
+        }
+    }
+
+    fi->fh = (uint64_t)(uintptr_t)fh;
+    fuse_reply_open(req, fi);
+    return;
+
+fail:
+    free(fh);
+    fuse_reply_err(req, errno ? errno : EIO);
+}
+
+static void mp3fs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                          off_t off, struct fuse_file_info *fi) {
+    (void)ino;
+    struct file_handle* fh = (struct file_handle*)(uintptr_t)fi->fh;
+    ssize_t read;
+    char* buf;
+
+#if FUSE_VERSION >= 29
+    /*
+     * Plain files and finished transcodes are handed to FUSE by
+     * descriptor, so that they can be spliced instead of copied.
+     */
+    int fd = fh->trans ? transcoder_fd(fh->trans) : fh->fd;
+    if (fd != -1) {
+        if (fh->trans) {
+            /* Stored output may be followed by other data. */
+            size_t filesize = transcoder_get_size(fh->trans);
+            if ((size_t)off >= filesize) {
+                size = 0;
+            } else if (off + size > filesize) {
+                size = filesize - off;
+            }
+        }
+        struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+        bufv.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        bufv.buf[0].fd = fd;
+        bufv.buf[0].pos = off;
+        fuse_reply_data(req, &bufv, FUSE_BUF_SPLICE_MOVE);
+        if (fh->trans) {
+            transcoder_fd_read(fh->trans, off, size);
+        }
+        return;
+    }
+#endif
+
+    buf = malloc(size);
+    if (!buf) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    errno = 0;
+    if (fh->trans) {
+        read = transcoder_read(fh->trans, buf, off, size);
+    } else {
+        read = pread(fh->fd, buf, size, off);
+    }
+
+    if (read > 0 || errno == 0) {
+        fuse_reply_buf(req, buf, read > 0 ? (size_t)read : 0);
+    } else {
+        fuse_reply_err(req, errno);
+    }
+    free(buf);
+}
+
+static void mp3fs_ll_release(fuse_req_t req, fuse_ino_t ino,
+                             struct fuse_file_info *fi) {
+    (void)ino;
+    struct file_handle* fh = (struct file_handle*)(uintptr_t)fi->fh;
+
+    if (fh->trans) {
+        transcoder_finish(fh->trans);
+        transcoder_delete(fh->trans);
+    }
+    if (fh->fd != -1) {
+        close(fh->fd);
+    }
+    free(fh);
+
+    fuse_reply_err(req, 0);
+}
+
+static void mp3fs_ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+    (void)ino;
+    struct statvfs stbuf;
+
+    if (fstatvfs(root.fd, &stbuf) == -1) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+
+    fuse_reply_statfs(req, &stbuf);
+}
+
+static void mp3fs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+    (void)userdata;
+    mp3fs_conn_init(conn);
+}
+
+static struct fuse_lowlevel_ops mp3fs_ll_ops = {
+    .init         = mp3fs_ll_init,
+    .lookup       = mp3fs_ll_lookup,
+    .forget       = mp3fs_ll_forget,
+    .getattr      = mp3fs_ll_getattr,
+    .readlink     = mp3fs_ll_readlink,
+    .open         = mp3fs_ll_open,
+    .read         = mp3fs_ll_read,
+    .release      = mp3fs_ll_release,
+    .opendir      = mp3fs_ll_opendir,
+    .readdir      = mp3fs_ll_readdir,
+    .releasedir   = mp3fs_ll_releasedir,
+    .statfs       = mp3fs_ll_statfs,
+#if FUSE_VERSION >= 29
+    .forget_multi = mp3fs_ll_forget_multi,
+#endif
+#if FUSE_USE_VERSION >= 30
+    .readdirplus  = mp3fs_ll_readdirplus,
+#endif
+};
+
+/*
+ * Mount the filesystem and run the low-level FUSE session until it is
+ * unmounted. Takes the remaining command line arguments, and returns the
+ * exit status for the program.
+ */
+#if FUSE_USE_VERSION >= 30
+int mp3fs_ll_main(struct fuse_args* args) {
+    struct fuse_cmdline_opts opts;
+    int ret = -1;
+
+    root.fd = open(params.basepath, O_RDONLY | O_DIRECTORY);
+    if (root.fd == -1) {
+        fprintf(stderr, "Cannot open flacdir: %s\n", strerror(errno));
+        return 1;
+    }
+    root.path = (char*)params.basepath;
+    root.refs = 1;
+
+    if (fuse_parse_cmdline(args, &opts) != 0) {
+        goto parse_fail;
+    }
+
+    ll_session = fuse_session_new(args, &mp3fs_ll_ops, sizeof(mp3fs_ll_ops),
+                                  NULL);
+    if (!ll_session) {
+        goto session_fail;
+    }
+
+    if (fuse_set_signal_handlers(ll_session) == -1) {
+        goto signal_fail;
+    }
+
+    if (fuse_session_mount(ll_session, opts.mountpoint) == -1) {
+        goto mount_fail;
+    }
+
+    if (fuse_daemonize(opts.foreground) == 0) {
+        if (opts.singlethread) {
+            ret = fuse_session_loop(ll_session);
+        } else {
+            struct fuse_loop_config config;
+            config.clone_fd = opts.clone_fd;
+            config.max_idle_threads = opts.max_idle_threads;
+            ret = fuse_session_loop_mt(ll_session, &config);
+        }
+        stop_inval();
+    }
+
+    fuse_session_unmount(ll_session);
+mount_fail:
+    fuse_remove_signal_handlers(ll_session);
+signal_fail:
+    fuse_session_destroy(ll_session);
+session_fail:
+    free(opts.mountpoint);
+parse_fail:
+    close(root.fd);
+    return ret == 0 ? 0 : 1;
+}
+#else
+int mp3fs_ll_main(struct fuse_args* args) {
+    struct fuse_session* se;
+    char* mountpoint;
+    int multithreaded, foreground;
+    int ret = -1;
+
+    root.fd = open(params.basepath, O_RDONLY | O_DIRECTORY);
+    if (root.fd == -1) {
+        fprintf(stderr, "Cannot open flacdir: %s\n", strerror(errno));
+        return 1;
+    }
+    root.path = (char*)params.basepath;
+    root.refs = 1;
+
+    if (fuse_parse_cmdline(args, &mountpoint, &multithreaded,
+                           &foreground) == -1) {
+        goto parse_fail;
+    }
+
+    ll_chan = fuse_mount(mountpoint, args);
+    if (!ll_chan) {
+        goto mount_fail;
+    }
+
+    se = fuse_lowlevel_new(args, &mp3fs_ll_ops, sizeof(mp3fs_ll_ops), NULL);
+    if (!se) {
+        goto session_fail;
+    }
+
+    if (fuse_set_signal_handlers(se) == -1) {
+        goto signal_fail;
+    }
+    fuse_session_add_chan(se, ll_chan);
+
+#if FUSE_VERSION >= 27
+    if (fuse_daemonize(foreground) == 0) {
+#else
+    if (foreground || daemon(0, 0) == 0) {
+#endif
+        ret = multithreaded ? fuse_session_loop_mt(se)
+                            : fuse_session_loop(se);
+        stop_inval();
+    }
+
+    fuse_remove_signal_handlers(se);
+    fuse_session_remove_chan(ll_chan);
+signal_fail:
+    fuse_session_destroy(se);
+session_fail:
+    fuse_unmount(mountpoint, ll_chan);
+mount_fail:
+    free(mountpoint);
+parse_fail:
+    close(root.fd);
+    return ret == 0 ? 0 : 1;
+}
+#endif
@@ -21,12 +21,16 @@
 #include "mp3_encoder.h"
 
 #include <inttypes.h>
+#include <pthread.h>
 
+#include <algorithm>
 #include <cmath>
 #include <cstdlib>
+#include <list>
 #include <sstream>
 #include <vector>
 
+#include "mp3_frame_layout.h"
 #include "transcode.h"
 
 /* Keep these items in static scope. */
@@ -55,70 +59,239 @@ static void lame_debug(const char *fmt, va_list list) {
     lame_print(LOG_DEBUG, fmt, list);
 }
 
-}
-
 /*
- * Create MP3 encoder. Do not set any parameters specific to a
- * particular file. Currently error handling is poor. If we run out
- * of memory, these routines will fail silently.
+ * What a LAME encoder is initialized with besides the encoding options,
+ * which are the same for all files.
  */
-Mp3Encoder::Mp3Encoder() {
-    id3tag = id3_tag_new();
+struct lame_format {
+    int sample_rate;
+    int channels;
+    float scale;
 
-    mp3fs_debug("LAME ready to initialize.");
+    lame_format(int sample_rate, int channels, float scale)
+        : sample_rate(sample_rate), channels(channels), scale(scale) { }
 
-    lame_encoder = lame_init();
+    bool operator==(const lame_format& other) const {
+        return sample_rate == other.sample_rate
+            && channels == other.channels && scale == other.scale;
+    }
+};
 
-    set_text_tag(METATAG_ENCODER, PACKAGE_NAME);
+struct pooled_lame {
+    pooled_lame(const lame_format& format, lame_t lame)
+        : format(format), lame(lame) { }
+
+    lame_format format;
+    lame_t lame;
+};
+
+/*
+ * Initialized LAME encoders which have not encoded anything yet, oldest
+ * first. LAME cannot be reset after encoding a file, so each is used only
+ * once. When an encoder is done, a thread of its own prepares one with
+ * the same format for the next file, which is likely to be from the same
+ * album. That moves the cost of initializing LAME off the reads of both
+ * files.
+ */
+std::list<pooled_lame> lame_pool;
+pthread_mutex_t lame_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Formats waiting to be prepared, and the thread preparing them. */
+std::list<lame_format> lame_wanted;
+pthread_cond_t lame_wanted_cond = PTHREAD_COND_INITIALIZER;
+bool lame_preparer_started = false;
+
+/* Limit on the number of prepared encoders. */
+const size_t max_pooled_lame = 4;
+
+/* Create a LAME encoder and initialize it for the given format. */
+lame_t create_lame(const lame_format& format) {
+    lame_t lame = lame_init();
+    if (!lame) {
+        mp3fs_error("lame_init failed.");
+        return NULL;
+    }
 
     /* Set lame parameters. */
     if (params.vbr) {
-        lame_set_VBR(lame_encoder, vbr_default);
-        lame_set_VBR_q(lame_encoder, params.quality);
-        lame_set_VBR_mean_bitrate_kbps(lame_encoder, params.bitrate);
-        lame_set_bWriteVbrTag(lame_encoder, 1);
+        lame_set_VBR(lame, vbr_default);
+        lame_set_VBR_q(lame, params.quality);
+        lame_set_VBR_mean_bitrate_kbps(lame, params.bitrate);
+        lame_set_bWriteVbrTag(lame, 1);
     } else {
-        lame_set_quality(lame_encoder, params.quality);
-        lame_set_brate(lame_encoder, params.bitrate);
-        lame_set_bWriteVbrTag(lame_encoder, 0);
+        /* Use exactly the layout calculate_size() is based on. */
+        Mp3FrameLayout layout(format.sample_rate, format.channels,
+                              params.bitrate);
+        lame_set_quality(lame, params.quality);
+        lame_set_brate(lame, layout.bitrate());
+        lame_set_out_samplerate(lame, layout.sample_rate());
+        lame_set_bWriteVbrTag(lame, 0);
+    }
+
+    lame_set_errorf(lame, &lame_error);
+    lame_set_msgf(lame, &lame_msg);
+    lame_set_debugf(lame, &lame_debug);
+
+    lame_set_in_samplerate(lame, format.sample_rate);
+    lame_set_num_channels(lame, format.channels);
+    lame_set_scale(lame, format.scale);
+
+    mp3fs_debug("LAME partially initialized.");
+
+    /* Initialise encoder */
+    if (lame_init_params(lame) == -1) {
+        mp3fs_error("lame_init_params failed.");
+        lame_close(lame);
+        return NULL;
+    }
+
+    return lame;
+}
+
+/* Take a prepared encoder for the given format, or return NULL. */
+lame_t take_pooled_lame(const lame_format& format) {
+    lame_t lame = NULL;
+
+    pthread_mutex_lock(&lame_pool_lock);
+    for (std::list<pooled_lame>::iterator it = lame_pool.begin();
+         it != lame_pool.end(); ++it) {
+        if (it->format == format) {
+            lame = it->lame;
+            lame_pool.erase(it);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lame_pool_lock);
+
+    return lame;
+}
+
+/*
+ * Prepare an encoder for the given format, unless there already is one,
+ * dropping the oldest if there are too many.
+ */
+void fill_lame_pool(const lame_format& format) {
+    pthread_mutex_lock(&lame_pool_lock);
+    for (std::list<pooled_lame>::iterator it = lame_pool.begin();
+         it != lame_pool.end(); ++it) {
+        if (it->format == format) {
+            pthread_mutex_unlock(&lame_pool_lock);
+            return;
+        }
     }
+    pthread_mutex_unlock(&lame_pool_lock);
+
+    lame_t lame = create_lame(format);
+    if (!lame) {
+        return;
+    }
+
+    lame_t dropped = NULL;
+    pthread_mutex_lock(&lame_pool_lock);
+    lame_pool.push_back(pooled_lame(format, lame));
+    if (lame_pool.size() > max_pooled_lame) {
+        dropped = lame_pool.front().lame;
+        lame_pool.pop_front();
+    }
+    pthread_mutex_unlock(&lame_pool_lock);
+
+    if (dropped) {
+        lame_close(dropped);
+    }
+}
+
+/* Prepare the wanted encoders as they are asked for. */
+void* prepare_lame(void* arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&lame_pool_lock);
+    while (true) {
+        while (lame_wanted.empty()) {
+            pthread_cond_wait(&lame_wanted_cond, &lame_pool_lock);
+        }
+        lame_format format = lame_wanted.front();
+        lame_wanted.pop_front();
+        pthread_mutex_unlock(&lame_pool_lock);
+
+        fill_lame_pool(format);
+
+        pthread_mutex_lock(&lame_pool_lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * Ask for an encoder for the given format to be prepared in the
+ * background. If the thread cannot be started, none is.
+ */
+void want_lame(const lame_format& format) {
+    pthread_mutex_lock(&lame_pool_lock);
+    if (lame_wanted.size() < max_pooled_lame
+        && std::find(lame_wanted.begin(), lame_wanted.end(), format)
+            == lame_wanted.end()) {
+        if (!lame_preparer_started) {
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, prepare_lame, NULL) == 0) {
+                pthread_detach(thread);
+                lame_preparer_started = true;
+            }
+        }
+        if (lame_preparer_started) {
+            lame_wanted.push_back(format);
+            pthread_cond_signal(&lame_wanted_cond);
+        }
+    }
+    pthread_mutex_unlock(&lame_pool_lock);
+}
+
+}
+
+/*
+ * Create MP3 encoder. Do not set any parameters specific to a
+ * particular file. The LAME encoder itself is not created until it is
+ * needed, so that opening a file to read only its tags stays cheap.
+ */
+Mp3Encoder::Mp3Encoder() : lame_encoder(NULL), id3size(0), num_samples(0),
+                           sample_rate(0), channels(0), gain_scale(1.0f),
+                           encoded_samples(0), encoded_bytes(0) {
+    id3tag = id3_tag_new();
 
-    lame_set_errorf(lame_encoder, &lame_error);
-    lame_set_msgf(lame_encoder, &lame_msg);
-    lame_set_debugf(lame_encoder, &lame_debug);
+    set_text_tag(METATAG_ENCODER, PACKAGE_NAME);
 }
 
 /*
  * Destroy private encode data. libid3tag asserts that id3tag is nonzero,
- * so we have to check ourselves to avoid this case.
+ * so we have to check ourselves to avoid this case. If LAME was used, an
+ * encoder for the same format is prepared in the background for the next
+ * file.
  */
 Mp3Encoder::~Mp3Encoder() {
-    if (!id3tag) {
+    if (id3tag) {
         id3_tag_delete(id3tag);
     }
-    lame_close(lame_encoder);
+    if (lame_encoder) {
+        lame_close(lame_encoder);
+        want_lame(lame_format(sample_rate, channels, gain_scale));
+    }
 }
 
 /*
  * Set pcm stream parameters to be used by LAME encoder. This should be
  * called as soon as the information is available and must be called
- * before encode_pcm_data can be called.
+ * before encode_pcm_data can be called. The parameters are only stored
+ * here; LAME is initialized with them by init_lame().
  */
 int Mp3Encoder::set_stream_params(uint64_t num_samples, int sample_rate,
                                    int channels) {
-    lame_set_num_samples(lame_encoder, num_samples);
-    lame_set_in_samplerate(lame_encoder, sample_rate);
-    lame_set_num_channels(lame_encoder, channels);
-
-    mp3fs_debug("LAME partially initialized.");
-
-    /* Initialise encoder */
-    if (lame_init_params(lame_encoder) == -1) {
-        mp3fs_debug("lame_init_params failed.");
+    if (sample_rate <= 0 || channels <= 0) {
+        mp3fs_debug("Invalid stream parameters.");
         return -1;
     }
 
-    mp3fs_debug("LAME initialized.");
+    this->num_samples = num_samples;
+    this->sample_rate = sample_rate;
+    this->channels = channels;
 
     /*
      * Set the length in the ID3 tag, as this is the most convenient place
@@ -131,6 +304,39 @@ int Mp3Encoder::set_stream_params(uint64_t num_samples, int sample_rate,
     return 0;
 }
 
+/*
+ * Create and initialize the LAME encoder from the stored stream
+ * parameters, if this has not been done already. This is the expensive
+ * part of setting up the encoder, so it is deferred until encoded data is
+ * actually needed, and a prepared encoder is used if there is one. The
+ * number of samples only matters for the size LAME reports, so it is set
+ * afterwards.
+ */
+int Mp3Encoder::init_lame() {
+    if (lame_encoder) {
+        return 0;
+    }
+
+    lame_format format(sample_rate, channels, gain_scale);
+    lame_encoder = take_pooled_lame(format);
+    if (lame_encoder) {
+        mp3fs_debug("LAME taken from pool.");
+    } else {
+        mp3fs_debug("LAME ready to initialize.");
+        lame_encoder = create_lame(format);
+        if (!lame_encoder) {
+            return -1;
+        }
+    }
+
+    lame_set_num_samples(lame_encoder, num_samples);
+
+    mp3fs_debug("LAME initialized.");
+
+    return 0;
+}
+
+
 /*
  * Set an ID3 text tag (one whose name begins with "T") to have the
  * specified value. This can be called multiple times with the same key,
@@ -142,12 +348,15 @@ void Mp3Encoder::set_text_tag(const int key, const char* value) {
         return;
     }
 
-    meta_map_t::const_iterator it = metatag_map.find(key);
+    const char* frame_name = NULL;
+    if (key >= 0 && key < NUMBER_METATAG_FIELDS) {
+        frame_name = metatag_frames[key];
+    }
 
-    if (it != metatag_map.end()) {
-        struct id3_frame* frame = id3_tag_findframe(id3tag, it->second, 0);
+    if (frame_name) {
+        struct id3_frame* frame = id3_tag_findframe(id3tag, frame_name, 0);
         if (!frame) {
-            frame = id3_frame_new(it->second);
+            frame = id3_frame_new(frame_name);
             id3_tag_attachframe(id3tag, frame);
 
             id3_field_settextencoding(id3_frame_field(frame, 0),
@@ -229,33 +438,31 @@ void Mp3Encoder::set_picture_tag(const char* mime_type, int type,
  */
 void Mp3Encoder::set_gain_db(const double dbgain) {
     mp3fs_debug("LAME setting gain to %f.", dbgain);
-    lame_set_scale(lame_encoder, (float)pow(10.0, dbgain/20));
+    gain_scale = (float)pow(10.0, dbgain/20);
 }
 
 /*
- * Render the closing ID3 tag into the reference Bufffer.  For VBR files this
- * will render the ID3v1 tag at the current end of the buffer.  For CBR files
- * this will do nothing.
+ * Render the closing ID3 tag into the referenced Buffer. This renders the
+ * ID3v1 tag, which has a fixed size of 128 bytes, at the current position
+ * of the Buffer. It may be called before any audio has been encoded, as
+ * the transcoder keeps the closing tag aside until the end of the file is
+ * reached.
  */
 int Mp3Encoder::render_close_tag(Buffer& buffer) {
-    if (params.vbr) {
-        id3_tag_options(id3tag, ID3_TAG_OPTION_ID3V1, ~0);
-        uint8_t* write_ptr = buffer.write_prepare(128, buffer.tell());
-        if (!write_ptr) {
-            return -1;
-        }
-        id3size = id3_tag_render(id3tag, write_ptr);
-        buffer.increment_pos(id3size);
+    id3_tag_options(id3tag, ID3_TAG_OPTION_ID3V1, ~0);
+    uint8_t* write_ptr = buffer.write_prepare(128);
+    if (!write_ptr) {
+        return -1;
     }
+    buffer.increment_pos(id3_tag_render(id3tag, write_ptr));
+    id3_tag_options(id3tag, ID3_TAG_OPTION_ID3V1, 0);
 
     return 0;
 }
 
 /*
  * Render the beginning ID3 tag into the referenced Buffer. This should be the
- * first thing to go into the Buffer. For CBR files the ID3v1 tag will also be
- * written 128 bytes from the calculated end of the buffer. It has a fixed
- * size.
+ * first thing to go into the Buffer.
  */
 int Mp3Encoder::render_start_tag(Buffer& buffer) {
     /*
@@ -266,44 +473,36 @@ int Mp3Encoder::render_start_tag(Buffer& buffer) {
      * Some players = iTunes
      */
     id3_tag_options(id3tag, ID3_TAG_OPTION_COMPRESSION, 0);
-    id3_tag_setlength(id3tag, id3_tag_render(id3tag, 0) + 12);
+    id3_length_t length = id3_tag_render(id3tag, 0) + 12;
+    id3_tag_setlength(id3tag, length);
 
-    // grow buffer and write v2 tag
-    uint8_t* write_ptr = buffer.write_prepare(id3_tag_render(id3tag, 0));
+    /*
+     * Grow buffer and write v2 tag. The padded length set above is exactly
+     * the size the tag will render to, so there is no need to render it
+     * again just to measure it.
+     */
+    uint8_t* write_ptr = buffer.write_prepare(length);
     if (!write_ptr) {
         return -1;
     }
     id3size = id3_tag_render(id3tag, write_ptr);
     buffer.increment_pos(id3size);
 
-    /* Write v1 tag at end of buffer.  This can not be done with VBR because
-     * the size of the file is unkown until after it is encoded. */
-    if (!params.vbr) {
-        id3_tag_options(id3tag, ID3_TAG_OPTION_ID3V1, ~0);
-        write_ptr = buffer.write_prepare(128, calculate_size() - 128);
-        if (!write_ptr) {
-            return -1;
-        }
-        id3_tag_render(id3tag, write_ptr);
-    }
-
     return 0;
 }
 
 /*
- * Properly calculate final file size. This is the sum of the size of
- * ID3v2, ID3v1, and raw MP3 data. This is theoretically only approximate
- * but in practice gives excellent answers, usually exactly correct.
- * Cast to 64-bit int to avoid overflow.
+ * Calculate the final file size for CBR. This is the sum of the size of
+ * ID3v2, ID3v1, and raw MP3 data, whose frames are laid out exactly as
+ * Mp3FrameLayout describes, so LAME is not needed for it.
  */
-size_t Mp3Encoder::calculate_size() const {
-    if (params.vbr) {
+size_t Mp3Encoder::calculate_size() {
+    if (params.vbr || sample_rate <= 0) {
         return 0;
-    } else {
-        return id3size + 128
-        + (uint64_t)lame_get_totalframes(lame_encoder)*144*params.bitrate*10
-        / (lame_get_out_samplerate(lame_encoder)/100);
     }
+
+    Mp3FrameLayout layout(sample_rate, channels, params.bitrate);
+    return (size_t)(id3size + 128 + layout.audio_size(num_samples));
 }
 
 /*
@@ -319,6 +518,10 @@ size_t Mp3Encoder::calculate_size() const {
  */
 int Mp3Encoder::encode_pcm_data(const int32_t* const data[], int numsamples,
                                 int sample_size, Buffer& buffer) {
+    if (init_lame() == -1) {
+        return -1;
+    }
+
     /*
      * We need to properly resample input data to a format LAME wants. LAME
      * requires samples in a C89 sized type, left aligned (i.e. scaled to
@@ -331,7 +534,7 @@ int Mp3Encoder::encode_pcm_data(const int32_t* const data[], int numsamples,
     for (int i=0; i<numsamples; ++i) {
         lbuf[i] = (int)data[0][i] << (sizeof(int)*8 - sample_size);
         /* ignore rbuf for mono data */
-        if (lame_get_num_channels(lame_encoder) > 1) {
+        if (channels > 1) {
             rbuf[i] = (int)data[1][i] << (sizeof(int)*8 - sample_size);
         }
     }
@@ -349,6 +552,8 @@ int Mp3Encoder::encode_pcm_data(const int32_t* const data[], int numsamples,
     }
 
     buffer.increment_pos(len);
+    encoded_samples += numsamples;
+    encoded_bytes += len;
 
     return 0;
 }
@@ -359,6 +564,10 @@ int Mp3Encoder::encode_pcm_data(const int32_t* const data[], int numsamples,
  * passed to encode_pcm_data().
  */
 int Mp3Encoder::encode_finish(Buffer& buffer) {
+    if (init_lame() == -1) {
+        return -1;
+    }
+
     uint8_t* write_ptr = buffer.write_prepare(7200);
     if (!write_ptr) {
         return -1;
@@ -370,35 +579,55 @@ int Mp3Encoder::encode_finish(Buffer& buffer) {
     }
 
     buffer.increment_pos(len);
+    encoded_bytes += len;
 
     return len;
 }
 
 /*
- * This function creates the metadata tag map from the standard values in the
- * enum in coders.h to ID3 values. It will be called only once to set the
- * metatag_map static variable.
+ * Give the bytes of audio output per second of audio. For CBR, this is
+ * the bitrate of Mp3FrameLayout, which may differ from the one asked
+ * for. For VBR, it is the average of what has been encoded so far, or 0
+ * if nothing has been.
  */
-const Mp3Encoder::meta_map_t Mp3Encoder::create_meta_map() {
-    meta_map_t m;
-
-    m[METATAG_TITLE] = "TIT2";
-    m[METATAG_ARTIST] = "TPE1";
-    m[METATAG_ALBUM] = "TALB";
-    m[METATAG_GENRE] = "TCON";
-    m[METATAG_DATE] = "TDRC";
-    m[METATAG_COMPOSER] = "TCOM";
-    m[METATAG_PERFORMER] = "TOPE";
-    m[METATAG_COPYRIGHT] = "TCOP";
-    m[METATAG_ENCODEDBY] = "TENC";
-    m[METATAG_ORGANIZATION] = "TPUB";
-    m[METATAG_CONDUCTOR] = "TPE3";
-    m[METATAG_ALBUMARTIST] = "TPE2";
-    m[METATAG_ENCODER] = "TSSE";
-    m[METATAG_TRACKLENGTH] = "TLEN";
-
-    return m;
+double Mp3Encoder::output_rate() const {
+    if (sample_rate <= 0) {
+        return 0;
+    }
+
+    if (!params.vbr) {
+        Mp3FrameLayout layout(sample_rate, channels, params.bitrate);
+        return (double)layout.bitrate() * 1000 / 8;
+    }
+
+    if (encoded_samples == 0 || encoded_bytes == 0) {
+        return 0;
+    }
+    return (double)encoded_bytes * sample_rate / (double)encoded_samples;
 }
 
-const Mp3Encoder::meta_map_t Mp3Encoder::metatag_map
-    = Mp3Encoder::create_meta_map();
+/*
+ * Map from the standard values in the enum in coders.h to ID3 frame names.
+ * Entries must be in the same order as the enum. Tags which need special
+ * handling in set_text_tag() have no frame name here.
+ */
+const char* const Mp3Encoder::metatag_frames[NUMBER_METATAG_FIELDS] = {
+    "TIT2",     /* METATAG_TITLE */
+    "TPE1",     /* METATAG_ARTIST */
+    "TALB",     /* METATAG_ALBUM */
+    "TCON",     /* METATAG_GENRE */
+    "TDRC",     /* METATAG_DATE */
+    "TCOM",     /* METATAG_COMPOSER */
+    "TOPE",     /* METATAG_PERFORMER */
+    "TCOP",     /* METATAG_COPYRIGHT */
+    "TENC",     /* METATAG_ENCODEDBY */
+    "TPUB",     /* METATAG_ORGANIZATION */
+    "TPE3",     /* METATAG_CONDUCTOR */
+    "TPE2",     /* METATAG_ALBUMARTIST */
+    NULL,       /* METATAG_TRACKNUMBER */
+    NULL,       /* METATAG_TRACKTOTAL */
+    NULL,       /* METATAG_DISCNUMBER */
+    NULL,       /* METATAG_DISCTOTAL */
+    "TSSE",     /* METATAG_ENCODER */
+    "TLEN",     /* METATAG_TRACKLENGTH */
+};
@@ -23,8 +23,6 @@
 
 #include "coders.h"
 
-#include <map>
-
 #include <id3tag.h>
 #include <lame/lame.h>
 
@@ -42,17 +40,23 @@ public:
     void set_gain_db(const double dbgain);
     int render_close_tag(Buffer& buffer);
     int render_start_tag(Buffer& buffer);
-    size_t calculate_size() const;
+    size_t calculate_size();
     int encode_pcm_data(const int32_t* const data[], int numsamples,
                         int sample_size, Buffer& buffer);
     int encode_finish(Buffer& buffer);
+    double output_rate() const;
 private:
+    int init_lame();
     lame_t lame_encoder;
     struct id3_tag* id3tag;
     size_t id3size;
-    typedef std::map<int,const char*> meta_map_t;
-    static const meta_map_t create_meta_map();
-    static const meta_map_t metatag_map;
+    uint64_t num_samples;
+    int sample_rate;
+    int channels;
+    float gain_scale;
+    uint64_t encoded_samples;
+    size_t encoded_bytes;
+    static const char* const metatag_frames[NUMBER_METATAG_FIELDS];
 };
 
 #endif
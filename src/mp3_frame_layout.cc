@@ -0,0 +1,205 @@
+/*
+ * MP3 frame layout source for mp3fs
+ *
+ * Copyright (C) 2013 Kristofer Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "mp3_frame_layout.h"
+
+#include <cstdlib>
+
+namespace {
+
+/* Lowpass frequency LAME uses for each CBR bitrate. */
+const struct {
+    int bitrate;
+    int lowpass;
+} lowpass_table[] = {
+    {   8,  2000 }, {  16,  3700 }, {  24,  3900 }, {  32,  5500 },
+    {  40,  7000 }, {  48,  7500 }, {  56, 10000 }, {  64, 11000 },
+    {  80, 13500 }, {  96, 15100 }, { 112, 15600 }, { 128, 17000 },
+    { 160, 17500 }, { 192, 18600 }, { 224, 19400 }, { 256, 19700 },
+    { 320, 20500 },
+};
+
+const size_t lowpass_table_size
+    = sizeof(lowpass_table) / sizeof(lowpass_table[0]);
+
+/* Bitrates allowed for MPEG-2, MPEG-1 and MPEG-2.5, as in LAME. */
+const int bitrate_table[3][15] = {
+    { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },
+    { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 },
+    { 0, 8, 16, 24, 32, 40, 48, 56, 64, -1, -1, -1, -1, -1, -1 },
+};
+
+/* Granule size of Layer III, and the delay LAME adds at the start. */
+const uint64_t granule_samples = 576;
+
+/* Input samples the resampling filter of LAME reaches ahead. */
+const uint64_t resample_delay = 16;
+
+}
+
+/*
+ * Choose the output sample rate and bitrate for an input with the given
+ * sample rate and channels, encoded at the given bitrate.
+ */
+Mp3FrameLayout::Mp3FrameLayout(int input_rate, int channels, int bitrate)
+    : in_rate(input_rate) {
+    int limit = lowpass(bitrate, channels);
+    if (2*limit > input_rate) {
+        limit = input_rate / 2;
+    }
+    out_rate = optimum_rate(limit, input_rate);
+    out_bitrate = nearest_bitrate(bitrate, out_rate);
+}
+
+int Mp3FrameLayout::samples_per_frame() const {
+    return version() ? 1152 : 576;
+}
+
+/* Size of a frame without padding. */
+uint64_t Mp3FrameLayout::frame_size() const {
+    return frame_bits() / out_rate;
+}
+
+/* Number of padded frames among the first frames of the output. */
+uint64_t Mp3FrameLayout::padded_frames(uint64_t frames) const {
+    if (frames == 0) {
+        return 0;
+    }
+
+    uint64_t frac = frame_bits() % out_rate;
+    return ((frames - 1)*frac + out_rate - 1) / out_rate;
+}
+
+/*
+ * Number of frames LAME writes for the given number of input samples per
+ * channel. When resampling, LAME's filter holds back the last 16 input
+ * samples until the flush, and the flush counts 16 input samples of
+ * filter delay, truncated to output samples.
+ */
+uint64_t Mp3FrameLayout::frame_count(uint64_t num_samples) const {
+    uint64_t frame_samples = samples_per_frame();
+    uint64_t samples = num_samples;
+    if (in_rate != out_rate) {
+        samples = 0;
+        if (num_samples > resample_delay) {
+            samples = ((num_samples - resample_delay)*out_rate + in_rate - 1)
+                / in_rate;
+        }
+        samples += resample_delay*out_rate / in_rate;
+    }
+
+    samples += granule_samples;
+    uint64_t end_padding = frame_samples - samples % frame_samples;
+    if (end_padding < granule_samples) {
+        end_padding += frame_samples;
+    }
+
+    return (samples + end_padding) / frame_samples;
+}
+
+/* Size of the audio data for the given number of input samples. */
+uint64_t Mp3FrameLayout::audio_size(uint64_t num_samples) const {
+    uint64_t frames = frame_count(num_samples);
+    return frames*frame_size() + padded_frames(frames);
+}
+
+/*
+ * Lowpass frequency for a bitrate, from the nearest one in the table, or
+ * the higher of two equally near. Mono gets a higher one, as all the bits
+ * go to one channel.
+ */
+int Mp3FrameLayout::lowpass(int bitrate, int channels) {
+    size_t best = 0;
+    for (size_t i=1; i<lowpass_table_size; ++i) {
+        if (abs(lowpass_table[i].bitrate - bitrate)
+            <= abs(lowpass_table[best].bitrate - bitrate)) {
+            best = i;
+        }
+    }
+
+    int result = lowpass_table[best].lowpass;
+    if (channels == 1) {
+        result = result * 3 / 2;
+    }
+    return result;
+}
+
+/*
+ * Sample rate LAME picks for an input: the highest MPEG rate not above
+ * the input rate, lowered where the lowpass frequency leaves no use for
+ * it, but never below the input rate.
+ */
+int Mp3FrameLayout::optimum_rate(int lowpass, int input_rate) {
+    static const int rates[] = {
+        48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000
+    };
+    static const int limits[] = {
+        0, 15960, 15250, 11220, 9970, 7230, 5420, 4510, 3970
+    };
+    const size_t num_rates = sizeof(rates) / sizeof(rates[0]);
+
+    int suggested = 44100;
+    for (size_t i=0; i<num_rates; ++i) {
+        if (input_rate >= rates[i]) {
+            suggested = rates[i];
+            break;
+        }
+    }
+
+    for (size_t i=1; i<num_rates; ++i) {
+        if (lowpass <= limits[i]) {
+            suggested = rates[i];
+        }
+    }
+
+    /* Use the lowest MPEG rate above the input rate instead. */
+    if (input_rate < suggested) {
+        for (size_t i=1; i<num_rates; ++i) {
+            if (input_rate > rates[i]) {
+                return rates[i - 1];
+            }
+        }
+        return 8000;
+    }
+
+    return suggested;
+}
+
+/*
+ * Nearest bitrate allowed at a sample rate, preferring the lower one of
+ * two equally near.
+ */
+int Mp3FrameLayout::nearest_bitrate(int bitrate, int sample_rate) {
+    int table = sample_rate < 16000 ? 2 : sample_rate >= 32000 ? 1 : 0;
+
+    int best = bitrate_table[table][1];
+    for (int i=2; i<15; ++i) {
+        int candidate = bitrate_table[table][i];
+        if (candidate > 0 && abs(candidate - bitrate) < abs(best - bitrate)) {
+            best = candidate;
+        }
+    }
+    return best;
+}
+
+/* Bytes per frame, times the sample rate. */
+uint64_t Mp3FrameLayout::frame_bits() const {
+    return (uint64_t)(version() + 1) * 72000 * out_bitrate;
+}
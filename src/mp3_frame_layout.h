@@ -0,0 +1,64 @@
+/*
+ * MP3 frame layout header for mp3fs
+ *
+ * Copyright (C) 2013 Kristofer Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef MP3_FRAME_LAYOUT_H
+#define MP3_FRAME_LAYOUT_H
+
+#include <stdint.h>
+
+/*
+ * Layout of the frames of CBR MPEG-1, MPEG-2 and MPEG-2.5 Layer III audio
+ * as LAME writes it, so that the size of the output is known exactly
+ * without initializing LAME. The output sample rate and bitrate are
+ * chosen from the input the way LAME chooses them, and the encoder sets
+ * them explicitly, so the two cannot disagree. Where LAME resamples, the
+ * number of frames also follows the delay of its resampling filter.
+ *
+ * A frame holds (version + 1) * 72000 * kbps / rate bytes, where version
+ * is 1 for MPEG-1 and 0 otherwise. The fraction is made up by padding
+ * frames with one extra byte, spread as LAME spreads them: the first
+ * frame is never padded. LAME also adds 576 samples of encoder delay at
+ * the start, and at least 576 samples of padding at the end.
+ */
+class Mp3FrameLayout {
+public:
+    Mp3FrameLayout(int input_rate, int channels, int bitrate);
+
+    int sample_rate() const { return out_rate; }
+    int bitrate() const { return out_bitrate; }
+    int samples_per_frame() const;
+    uint64_t frame_size() const;
+    uint64_t padded_frames(uint64_t frames) const;
+    uint64_t frame_count(uint64_t num_samples) const;
+    uint64_t audio_size(uint64_t num_samples) const;
+private:
+    static int lowpass(int bitrate, int channels);
+    static int optimum_rate(int lowpass, int input_rate);
+    static int nearest_bitrate(int bitrate, int sample_rate);
+
+    int version() const { return out_rate >= 32000 ? 1 : 0; }
+    uint64_t frame_bits() const;
+
+    int in_rate;
+    int out_rate;
+    int out_bitrate;
+};
+
+#endif
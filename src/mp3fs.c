@@ -39,6 +39,29 @@ struct mp3fs_params params = {
 #ifdef HAVE_MP3
     .desttype  = "mp3",
 #endif
+    .maxpics    = -1,
+    .maxpicsize = 0,
+    .frontcover = 0,
+    .tagcache   = 32,
+    .tagcachedir = NULL,
+    .dircache   = 256,
+    .maxmemory  = 0,
+    .streamwindow = 0,
+    .cachedir   = NULL,
+    .cachefill  = 0,
+    .prefetch   = 0,
+    .clientjobs = 0,
+    .pace       = 0,
+    .lowlevel   = 0,
+    /*
+     * Files only change when their source files do, so the kernel can
+     * remember them, and the files which are missing, longer than usual.
+     * Players and file sharing clients repeatedly look for the same
+     * missing files.
+     */
+    .attr_timeout = 10.0,
+    .entry_timeout = 10.0,
+    .negative_timeout = 10.0,
 };
 
 enum {
@@ -64,6 +87,38 @@ static struct fuse_opt mp3fs_opts[] = {
     MP3FS_OPT("gainref=%f",       gainref, 0),
     MP3FS_OPT("--desttype=%s",    desttype, 0),
     MP3FS_OPT("desttype=%s",      desttype, 0),
+    MP3FS_OPT("--maxpics=%d",     maxpics, 0),
+    MP3FS_OPT("maxpics=%d",       maxpics, 0),
+    MP3FS_OPT("--maxpicsize=%u",  maxpicsize, 0),
+    MP3FS_OPT("maxpicsize=%u",    maxpicsize, 0),
+    MP3FS_OPT("--frontcover",     frontcover, 1),
+    MP3FS_OPT("frontcover",       frontcover, 1),
+    MP3FS_OPT("--tagcache=%u",    tagcache, 0),
+    MP3FS_OPT("tagcache=%u",      tagcache, 0),
+    MP3FS_OPT("--tagcachedir=%s", tagcachedir, 0),
+    MP3FS_OPT("tagcachedir=%s",   tagcachedir, 0),
+    MP3FS_OPT("--dircache=%u",    dircache, 0),
+    MP3FS_OPT("dircache=%u",      dircache, 0),
+    MP3FS_OPT("--maxmemory=%u",   maxmemory, 0),
+    MP3FS_OPT("maxmemory=%u",     maxmemory, 0),
+    MP3FS_OPT("--streamwindow=%u", streamwindow, 0),
+    MP3FS_OPT("streamwindow=%u",  streamwindow, 0),
+    MP3FS_OPT("--cachedir=%s",    cachedir, 0),
+    MP3FS_OPT("cachedir=%s",      cachedir, 0),
+    MP3FS_OPT("--cachefill",      cachefill, 1),
+    MP3FS_OPT("cachefill",        cachefill, 1),
+    MP3FS_OPT("--prefetch=%u",    prefetch, 0),
+    MP3FS_OPT("prefetch=%u",      prefetch, 0),
+    MP3FS_OPT("--clientjobs=%u",  clientjobs, 0),
+    MP3FS_OPT("clientjobs=%u",    clientjobs, 0),
+    MP3FS_OPT("--pace=%u",        pace, 0),
+    MP3FS_OPT("pace=%u",          pace, 0),
+
+    MP3FS_OPT("--lowlevel",       lowlevel, 1),
+    MP3FS_OPT("lowlevel",         lowlevel, 1),
+    MP3FS_OPT("attr_timeout=%lf", attr_timeout, 0),
+    MP3FS_OPT("entry_timeout=%lf", entry_timeout, 0),
+    MP3FS_OPT("negative_timeout=%lf", negative_timeout, 0),
 
     FUSE_OPT_KEY("-h",            KEY_HELP),
     FUSE_OPT_KEY("--help",        KEY_HELP),
@@ -98,6 +153,62 @@ Encoding options:\n\
                            reference value to use for ReplayGain in \n\
                            decibels: defaults to 89 dB\n\
 \n\
+Picture options:\n\
+    --maxpics=N, -omaxpics=N\n\
+                           copy at most N pictures into the tags; 0 strips\n\
+                           all pictures, and by default all are copied\n\
+    --maxpicsize=BYTES, -omaxpicsize=BYTES\n\
+                           skip pictures larger than BYTES; by default\n\
+                           there is no limit\n\
+    --frontcover, -ofrontcover\n\
+                           copy only front cover pictures\n\
+\n\
+Caching options:\n\
+    --tagcache=MB, -otagcache=MB\n\
+                           memory to use for caching rendered tags, in\n\
+                           megabytes: defaults to 32\n\
+    --tagcachedir=DIR, -otagcachedir=DIR\n\
+                           also keep rendered tags in DIR, so they are\n\
+                           kept across mounts\n\
+    --dircache=N, -odircache=N\n\
+                           number of directory listings to cache: 0\n\
+                           disables the cache, and 256 is the default\n\
+    --maxmemory=MB, -omaxmemory=MB\n\
+                           memory to use for transcoded data of open\n\
+                           files before moving it to temporary files: 0\n\
+                           means no limit, which is the default\n\
+    --streamwindow=KB, -ostreamwindow=KB\n\
+                           keep only KB of transcoded data around the\n\
+                           read position, for clients which read files\n\
+                           once from start to end: 0, the default, keeps\n\
+                           all data\n\
+    --cachedir=DIR, -ocachedir=DIR\n\
+                           serve transcoded files stored in DIR by\n\
+                           mp3fs-warm instead of encoding them\n\
+    --cachefill, -ocachefill\n\
+                           also store transcoded files in the cachedir\n\
+                           while the filesystem is idle\n\
+    --prefetch=PCT, -oprefetch=PCT\n\
+                           start transcoding the next file in a directory\n\
+                           once PCT percent of a file has been read: 0,\n\
+                           the default, disables this\n\
+    --clientjobs=N, -oclientjobs=N\n\
+                           most files to encode at once for a single\n\
+                           client process: 0, the default, means one\n\
+                           per processor\n\
+    --pace=SECONDS, -opace=SECONDS\n\
+                           encode at most SECONDS of audio ahead of real\n\
+                           time for each client reading a file: 0, the\n\
+                           default, encodes as fast as files are read\n\
+\n\
+FUSE options:\n\
+    --lowlevel, -olowlevel\n\
+                           use the FUSE low-level API, which looks up\n\
+                           files by inode instead of by path\n\
+    -oattr_timeout=T, -oentry_timeout=T, -onegative_timeout=T\n\
+                           seconds for which the kernel caches attributes,\n\
+                           names and missing names: 10 by default\n\
+\n\
 General options:\n\
     -h, --help             display this help and exit\n\
     -V, --version          output version information and exit\n\
@@ -118,7 +229,11 @@ static int mp3fs_opt_proc(void* data, const char* arg, int key,
 
         case KEY_HELP:
             usage(outargs->argv[0]);
+#if FUSE_USE_VERSION >= 30
+            fuse_opt_add_arg(outargs, "--help");
+#else
             fuse_opt_add_arg(outargs, "-ho");
+#endif
             fuse_main(outargs->argc, outargs->argv, &mp3fs_ops, NULL);
             exit(1);
 
@@ -180,6 +295,30 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    if (params.tagcachedir && params.tagcachedir[0] != '/') {
+        fprintf(stderr, "tagcachedir must be an absolute path.\n\n");
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (params.cachedir && params.cachedir[0] != '/') {
+        fprintf(stderr, "cachedir must be an absolute path.\n\n");
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (params.prefetch > 100) {
+        fprintf(stderr, "prefetch must be a percentage.\n\n");
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (params.cachefill && !params.cachedir) {
+        fprintf(stderr, "cachefill requires cachedir.\n\n");
+        usage(argv[0]);
+        return 1;
+    }
+
     /* Log to the screen if debug is enabled. */
     openlog("mp3fs", params.debug ? LOG_PERROR : 0, LOG_USER);
 
@@ -191,13 +330,47 @@ int main(int argc, char *argv[]) {
                 "gainmode:  %d\n"
                 "gainref:   %f\n"
                 "desttype:  %s\n"
+                "maxpics:   %d\n"
+                "maxpicsize: %u\n"
+                "frontcover: %s\n"
+                "tagcache:  %u\n"
+                "tagcachedir: %s\n"
+                "dircache:  %u\n"
+                "maxmemory: %u\n"
+                "streamwindow: %u\n"
+                "cachedir:  %s\n"
+                "cachefill: %s\n"
+                "prefetch:  %u\n"
+                "clientjobs: %u\n"
+                "pace:      %u\n"
+                "lowlevel:  %s\n"
                 "\n",
                 params.basepath, params.bitrate,
                 params.vbr ? "true" : "false",  params.quality,
-                params.gainmode, params.gainref, params.desttype);
+                params.gainmode, params.gainref, params.desttype,
+                params.maxpics, params.maxpicsize,
+                params.frontcover ? "true" : "false", params.tagcache,
+                params.tagcachedir ? params.tagcachedir : "(none)",
+                params.dircache, params.maxmemory, params.streamwindow,
+                params.cachedir ? params.cachedir : "(none)",
+                params.cachefill ? "true" : "false", params.prefetch,
+                params.clientjobs, params.pace,
+                params.lowlevel ? "true" : "false");
 
     // start FUSE
-    ret = fuse_main(args.argc, args.argv, &mp3fs_ops, NULL);
+    if (params.lowlevel) {
+        ret = mp3fs_ll_main(&args);
+    } else {
+#if FUSE_USE_VERSION < 30
+        /* FUSE 3 takes the timeouts from mp3fs_init instead. */
+        char timeouts[128];
+        snprintf(timeouts, sizeof(timeouts), "-oattr_timeout=%g,"
+                 "entry_timeout=%g,negative_timeout=%g", params.attr_timeout,
+                 params.entry_timeout, params.negative_timeout);
+        fuse_opt_add_arg(&args, timeouts);
+#endif
+        ret = fuse_main(args.argc, args.argv, &mp3fs_ops, NULL);
+    }
 
     fuse_opt_free_args(&args);
 
@@ -0,0 +1,327 @@
+/*
+ * Transcoded output store source for mp3fs
+ *
+ * Copyright (C) 2013 Kristofer Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "output_cache.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include <climits>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <vector>
+
+#include "scheduler.h"
+#include "transcode.h"
+
+namespace {
+
+/* Trailer at the end of a stored file, after the variable-length data. */
+struct disk_trailer {
+    char magic[8];
+    int64_t mtime;
+    int64_t source_size;
+    uint64_t encoded_size;
+    uint32_t signature_len;
+    uint32_t filename_len;
+};
+
+const char disk_magic[8] = {'M', 'P', '3', 'F', 'S', 'O', 'C', '1'};
+
+/* Amount of output to read from the transcoder at a time. */
+const size_t chunk_size = 128*1024;
+
+bool pread_fully(int fd, void* data, size_t len, off_t offset) {
+    return len == 0 || pread(fd, data, len, offset) == (ssize_t)len;
+}
+
+bool write_fully(int fd, const void* data, size_t len) {
+    const char* ptr = (const char*)data;
+    while (len > 0) {
+        ssize_t ret = write(fd, ptr, len);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        ptr += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+/*
+ * Read the whole output of a transcoder into a file, reporting progress
+ * to the throttle callback. Returns false on error.
+ */
+bool copy_output(struct transcoder* trans, int fd,
+                 outputcache_throttle_t throttle) {
+    std::vector<char> buf(chunk_size);
+    off_t offset = 0;
+
+    while (true) {
+        errno = 0;
+        ssize_t read = transcoder_read(trans, &buf[0], offset, buf.size());
+        if (read <= 0) {
+            return errno == 0;
+        }
+        if (!write_fully(fd, &buf[0], read)) {
+            return false;
+        }
+        offset += read;
+        if (throttle) {
+            throttle(read);
+        }
+    }
+}
+
+}
+
+/*
+ * Open the stored output for a source file with the given stat
+ * information. If a valid entry is found, its size is set and a file
+ * descriptor is returned, which the caller must close. Otherwise -1 is
+ * returned.
+ */
+int OutputCache::open(const std::string& filename, const struct stat& st,
+                      size_t& encoded_size) {
+    int fd = ::open(disk_name(filename).c_str(), O_RDONLY);
+    if (fd == -1) {
+        /* Not really an error. */
+        errno = 0;
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    struct stat disk_st;
+    struct disk_trailer trailer;
+    std::string signature, name;
+    bool ok = fstat(fd, &disk_st) == 0
+        && disk_st.st_size >= (off_t)sizeof(trailer)
+        && pread_fully(fd, &trailer, sizeof(trailer),
+                       disk_st.st_size - sizeof(trailer))
+        && memcmp(trailer.magic, disk_magic, sizeof(disk_magic)) == 0
+        && trailer.signature_len <= PATH_MAX
+        && trailer.filename_len <= PATH_MAX
+        && trailer.encoded_size + trailer.signature_len
+            + trailer.filename_len + sizeof(trailer)
+            == (uint64_t)disk_st.st_size
+        && trailer.mtime == (int64_t)st.st_mtime
+        && trailer.source_size == (int64_t)st.st_size;
+    if (ok) {
+        signature.resize(trailer.signature_len);
+        name.resize(trailer.filename_len);
+        ok = pread_fully(fd, &signature[0], signature.size(),
+                         (off_t)trailer.encoded_size)
+            && pread_fully(fd, &name[0], name.size(),
+                           (off_t)(trailer.encoded_size + signature.size()))
+            && signature == param_signature() && name == key(filename);
+    }
+
+    if (!ok) {
+        close(fd);
+        errno = 0;
+        return -1;
+    }
+
+    encoded_size = (size_t)trailer.encoded_size;
+    return fd;
+}
+
+/*
+ * Create a temporary file in the store to write the output for a source
+ * file into. Returns the file descriptor and sets its name, or returns -1.
+ * The file stays locked until it is closed, so that files being written
+ * can be told from those left behind by an interrupted writer.
+ */
+int OutputCache::create(const std::string& filename, std::string& tmp_path) {
+    tmp_path = disk_name(filename) + ".XXXXXX";
+
+    int fd = mkstemp(&tmp_path[0]);
+    if (fd == -1) {
+        mp3fs_debug("Cannot create output file for %s: %s",
+                    filename.c_str(), strerror(errno));
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    flock(fd, LOCK_EX);
+
+    return fd;
+}
+
+/*
+ * Append the trailer to a temporary file holding the complete output for
+ * a source file, and rename it into place, so readers never see a partial
+ * entry. The file descriptor is closed, and on failure the file removed.
+ */
+bool OutputCache::commit(int fd, const std::string& tmp_path,
+                         const std::string& filename, const struct stat& st,
+                         size_t encoded_size) {
+    std::string signature = param_signature();
+    std::string name = key(filename);
+
+    struct disk_trailer trailer;
+    memset(&trailer, 0, sizeof(trailer));
+    memcpy(trailer.magic, disk_magic, sizeof(disk_magic));
+    trailer.mtime = st.st_mtime;
+    trailer.source_size = st.st_size;
+    trailer.encoded_size = encoded_size;
+    trailer.signature_len = (uint32_t)signature.size();
+    trailer.filename_len = (uint32_t)name.size();
+
+    bool ok = ftruncate(fd, (off_t)encoded_size) == 0
+        && lseek(fd, (off_t)encoded_size, SEEK_SET) != -1
+        && write_fully(fd, signature.data(), signature.size())
+        && write_fully(fd, name.data(), name.size())
+        && write_fully(fd, &trailer, sizeof(trailer));
+    ok = (close(fd) == 0) && ok;
+
+    if (!ok || rename(tmp_path.c_str(), disk_name(filename).c_str()) == -1) {
+        mp3fs_debug("Cannot write output file for %s.", filename.c_str());
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Name of a source file relative to the source directory, which is what
+ * entries are keyed by.
+ */
+std::string OutputCache::key(const std::string& filename) {
+    size_t pos = 0;
+    size_t base_len = strlen(params.basepath);
+    if (filename.compare(0, base_len, params.basepath) == 0) {
+        pos = base_len;
+    }
+    while (pos < filename.size() && filename[pos] == '/') {
+        ++pos;
+    }
+
+    return filename.substr(pos);
+}
+
+/*
+ * Name of the stored file for a source file, formed from a 64-bit FNV-1a
+ * hash of its key. Collisions are detected by storing the key in the
+ * file.
+ */
+std::string OutputCache::disk_name(const std::string& filename) {
+    std::string name = key(filename);
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i=0; i<name.size(); ++i) {
+        hash ^= (uint8_t)name[i];
+        hash *= 1099511628211ULL;
+    }
+
+    char disk_name[32];
+    snprintf(disk_name, sizeof(disk_name), "/%016llx.out",
+             (unsigned long long)hash);
+
+    return std::string(params.cachedir) + disk_name;
+}
+
+/*
+ * Describe the program version and all parameters which affect the
+ * output. Entries created by another version or with other parameters
+ * are ignored.
+ */
+std::string OutputCache::param_signature() {
+    std::ostringstream tempstr;
+    tempstr << PACKAGE_VERSION << ":" << params.desttype << ":"
+        << params.bitrate << ":" << params.vbr << ":" << params.quality
+        << ":" << params.gainmode << ":" << params.gainref << ":"
+        << params.maxpics << ":" << params.maxpicsize << ":"
+        << params.frontcover;
+    return tempstr.str();
+}
+
+/* Use "C" linkage to allow access from C code. */
+extern "C" {
+
+/* Check whether a valid entry is stored for a source file. */
+int outputcache_check(const char* filename) {
+    struct stat st;
+    size_t encoded_size;
+
+    if (stat(filename, &st) == -1) {
+        return 0;
+    }
+
+    int fd = OutputCache::open(filename, st, encoded_size);
+    if (fd == -1) {
+        return 0;
+    }
+    close(fd);
+
+    return 1;
+}
+
+/*
+ * Transcode a source file completely and store the output. Returns -1 on
+ * error, including when the source file changes meanwhile.
+ */
+int outputcache_fill(const char* filename, outputcache_throttle_t throttle) {
+    struct stat st, st_after;
+    std::string tmp_path;
+
+    if (stat(filename, &st) == -1) {
+        return -1;
+    }
+
+    int fd = OutputCache::create(filename, tmp_path);
+    if (fd == -1) {
+        return -1;
+    }
+
+    std::vector<char> path(filename, filename + strlen(filename) + 1);
+    struct transcoder* trans = transcoder_new(&path[0]);
+    if (!trans || !copy_output(trans, fd, throttle)
+        || stat(filename, &st_after) == -1
+        || st_after.st_mtime != st.st_mtime
+        || st_after.st_size != st.st_size) {
+        if (trans) {
+            transcoder_delete(trans);
+        }
+        close(fd);
+        unlink(tmp_path.c_str());
+        return -1;
+    }
+
+    size_t encoded_size = transcoder_get_size(trans);
+    transcoder_delete(trans);
+
+    return OutputCache::commit(fd, tmp_path, filename, st, encoded_size)
+        ? 0 : -1;
+}
+
+/* Run the encoding of the calling thread as background filling. */
+void outputcache_worker() {
+    Scheduler::set_priority(Scheduler::FILL);
+}
+
+}
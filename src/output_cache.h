@@ -0,0 +1,51 @@
+/*
+ * Transcoded output store header for mp3fs
+ *
+ * Copyright (C) 2013 Kristofer Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef OUTPUT_CACHE_H
+#define OUTPUT_CACHE_H
+
+#include <sys/stat.h>
+
+#include <cstddef>
+#include <string>
+
+/*
+ * Store of complete transcoded files in a directory, so that they can be
+ * served without encoding. Each file holds the output followed by a
+ * trailer describing the source file and the parameters it was encoded
+ * with; the output can be read directly from the start of the file.
+ * Source files are named relative to the source directory, so the store
+ * does not depend on where it is mounted.
+ */
+class OutputCache {
+public:
+    static int open(const std::string& filename, const struct stat& st,
+                    size_t& encoded_size);
+    static int create(const std::string& filename, std::string& tmp_path);
+    static bool commit(int fd, const std::string& tmp_path,
+                       const std::string& filename, const struct stat& st,
+                       size_t encoded_size);
+private:
+    static std::string key(const std::string& filename);
+    static std::string disk_name(const std::string& filename);
+    static std::string param_signature();
+};
+
+#endif
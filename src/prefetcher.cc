@@ -0,0 +1,255 @@
+/*
+ * Next file prefetcher source for mp3fs
+ *
+ * Copyright (C) 2013 Kristofer Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "prefetcher.h"
+
+#include <dirent.h>
+
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#include "cache_filler.h"
+#include "scheduler.h"
+#include "transcode.h"
+
+namespace {
+
+/* Protects all of the static prefetcher state. */
+pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Signalled when a file is queued, and when the worker is not busy. */
+pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+
+/* Amount of output to encode at a time. */
+const size_t chunk_size = 32*1024;
+
+}
+
+std::string Prefetcher::pending;
+std::string Prefetcher::current_name;
+struct transcoder* Prefetcher::current = NULL;
+bool Prefetcher::busy = false;
+bool Prefetcher::started = false;
+pthread_t Prefetcher::worker;
+
+/*
+ * Start prefetching the file following the given one in its directory,
+ * unless it is already prefetched or stored. Reads by background threads
+ * are not taken as a sign of what will be played.
+ */
+void Prefetcher::add_next(const std::string& filename) {
+    if (!params.prefetch || is_worker() || CacheFiller::is_worker()) {
+        return;
+    }
+
+    std::string next = next_sibling(filename);
+    if (next.empty()) {
+        return;
+    }
+    if (params.cachedir && outputcache_check(next.c_str())) {
+        return;
+    }
+
+    pthread_mutex_lock(&prefetch_lock);
+    if (next != current_name && next != pending) {
+        pending = next;
+        if (!started) {
+            if (pthread_create(&worker, NULL, run, NULL) == 0) {
+                pthread_detach(worker);
+                started = true;
+            } else {
+                mp3fs_error("Unable to start prefetch thread.");
+            }
+        }
+        pthread_cond_broadcast(&prefetch_cond);
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+}
+
+/*
+ * Take the transcoder prefetched for a file, if there is one. The caller
+ * owns it afterwards, and must check that the source file is unchanged.
+ */
+struct transcoder* Prefetcher::take(const std::string& filename) {
+    if (!params.prefetch) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&prefetch_lock);
+    if (busy && current_name == filename) {
+        /* The client is waiting, so the worker should not. */
+        Scheduler::urge_begin();
+        while (busy && current_name == filename) {
+            pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+        }
+        Scheduler::urge_end();
+    }
+
+    struct transcoder* trans = NULL;
+    if (current && current_name == filename) {
+        trans = current;
+        current = NULL;
+        current_name.clear();
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+
+    return trans;
+}
+
+/*
+ * Transcode the queued file until it is taken, another file is queued,
+ * or it is finished. In streaming mode, only the first window is encoded,
+ * as more would be discarded, and in paced mode only the pace.
+ */
+void* Prefetcher::run(void* arg) {
+    (void)arg;
+
+    Scheduler::set_priority(Scheduler::PREFETCH);
+
+    std::vector<char> buf(chunk_size);
+    size_t limit = (size_t)-1;
+    if (params.streamwindow) {
+        limit = (size_t)params.streamwindow * 1024;
+    }
+
+    while (true) {
+        pthread_mutex_lock(&prefetch_lock);
+        while (pending.empty()) {
+            pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+        }
+
+        /* What was prefetched before was not opened. */
+        struct transcoder* old = current;
+        std::string filename = pending;
+        current = NULL;
+        current_name = filename;
+        pending.clear();
+        busy = true;
+        pthread_mutex_unlock(&prefetch_lock);
+
+        if (old) {
+            transcoder_delete(old);
+        }
+
+        mp3fs_debug("Prefetching %s.", filename.c_str());
+        std::vector<char> path(filename.c_str(),
+                               filename.c_str() + filename.size() + 1);
+        struct transcoder* trans = transcoder_new(&path[0]);
+
+        pthread_mutex_lock(&prefetch_lock);
+        current = trans;
+        if (!trans) {
+            current_name.clear();
+        }
+        busy = false;
+        pthread_cond_broadcast(&prefetch_cond);
+        pthread_mutex_unlock(&prefetch_lock);
+
+        off_t offset = 0;
+        while (trans && (size_t)offset < limit && within_pace(trans, offset)
+               && still_wanted(trans)) {
+            ssize_t read = transcoder_read(trans, &buf[0], offset,
+                                           buf.size());
+
+            pthread_mutex_lock(&prefetch_lock);
+            busy = false;
+            pthread_cond_broadcast(&prefetch_cond);
+            pthread_mutex_unlock(&prefetch_lock);
+
+            if (read <= 0) {
+                break;
+            }
+            offset += read;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Check whether encoding a transcoder up to the given offset stays within
+ * the pace, if any, of the start of its audio.
+ */
+bool Prefetcher::within_pace(struct transcoder* trans, off_t offset) {
+    if (!params.pace) {
+        return true;
+    }
+
+    double rate = transcoder_output_rate(trans);
+    return rate <= 0 || (double)offset < params.pace * rate;
+}
+
+/*
+ * Check whether a transcoder is still to be prefetched, and if so mark
+ * the worker as busy with it.
+ */
+bool Prefetcher::still_wanted(struct transcoder* trans) {
+    pthread_mutex_lock(&prefetch_lock);
+    bool wanted = current == trans && pending.empty();
+    if (wanted) {
+        busy = true;
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+
+    return wanted;
+}
+
+/*
+ * Find the source file following a file in name order in its directory,
+ * which is the track order for the usual numbered file names. Returns an
+ * empty string if there is none.
+ */
+std::string Prefetcher::next_sibling(const std::string& filename) {
+    size_t slash = filename.rfind('/');
+    if (slash == std::string::npos) {
+        return std::string();
+    }
+    std::string dirname = filename.substr(0, slash);
+    std::string name = filename.substr(slash + 1);
+
+    DIR* dp = opendir(dirname.empty() ? "/" : dirname.c_str());
+    if (!dp) {
+        errno = 0;
+        return std::string();
+    }
+
+    std::string next;
+    struct dirent* de;
+    while ((de = readdir(dp))) {
+        const char* ext = strrchr(de->d_name, '.');
+        if (ext && check_decoder(ext + 1) && name < de->d_name
+            && (next.empty() || next > de->d_name)) {
+            next = de->d_name;
+        }
+    }
+    closedir(dp);
+    errno = 0;
+
+    if (next.empty()) {
+        return next;
+    }
+    return dirname + "/" + next;
+}
+
+/* Check whether the calling thread is the worker. */
+bool Prefetcher::is_worker() {
+    return started && pthread_equal(pthread_self(), worker);
+}
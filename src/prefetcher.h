@@ -0,0 +1,57 @@
+/*
+ * Next file prefetcher header for mp3fs
+ *
+ * Copyright (C) 2013 Kristofer Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef PREFETCHER_H
+#define PREFETCHER_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include <string>
+
+struct transcoder;
+
+/*
+ * Worker thread which starts transcoding the file following one which has
+ * been read nearly to its end, so that the next track of an album is
+ * ready when a player opens it. One transcoder is prefetched at a time,
+ * and it is handed over to the next open of its file. While the worker is
+ * reading from it, the hand over waits, which takes at most one chunk.
+ */
+class Prefetcher {
+public:
+    static void add_next(const std::string& filename);
+    static struct transcoder* take(const std::string& filename);
+    static bool is_worker();
+private:
+    static void* run(void* arg);
+    static bool within_pace(struct transcoder* trans, off_t offset);
+    static bool still_wanted(struct transcoder* trans);
+    static std::string next_sibling(const std::string& filename);
+
+    static std::string pending;
+    static std::string current_name;
+    static struct transcoder* current;
+    static bool busy;
+    static bool started;
+    static pthread_t worker;
+};
+
+#endif
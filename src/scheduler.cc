@@ -0,0 +1,240 @@
+/*
+ * Transcoding work scheduler source for mp3fs
+ *
+ * Copyright (C) 2013 Kristofer Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "scheduler.h"
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstdio>
+
+#include "transcode.h"
+
+namespace {
+
+/* Protects the counts of working threads. */
+pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Signalled when a thread stops working. */
+pthread_cond_t sched_cond = PTHREAD_COND_INITIALIZER;
+
+/* Per-thread state, for threads which have set a priority. */
+pthread_key_t state_key;
+pthread_once_t state_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Seconds a thread waits before it is let through regardless, and for
+ * how long it is then let through. This leaves waiting threads about a
+ * tenth of the time.
+ */
+const double max_wait = 1.0;
+const double boost_time = 0.1;
+
+void create_key() {
+    pthread_key_create(&state_key, NULL);
+}
+
+double now(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* Wait on the condition for at most the given number of seconds. */
+void wait_for(double seconds) {
+    double until = now(CLOCK_REALTIME) + seconds;
+    struct timespec ts;
+    ts.tv_sec = (time_t)until;
+    ts.tv_nsec = (long)((until - (double)ts.tv_sec) * 1e9);
+    pthread_cond_timedwait(&sched_cond, &sched_lock, &ts);
+}
+
+}
+
+int Scheduler::working[PRIORITIES];
+int Scheduler::urgent = 0;
+std::map<pid_t,Scheduler::client_state> Scheduler::clients;
+
+/* Set the priority of the calling thread. */
+void Scheduler::set_priority(priority prio) {
+    thread_state* ts = state();
+    if (!ts) {
+        ts = new thread_state;
+        ts->boost_until = 0;
+        pthread_setspecific(state_key, ts);
+    }
+    ts->prio = prio;
+}
+
+/*
+ * Note that the calling thread starts encoding for a read by a client,
+ * first waiting for other reads of the client if it has too many.
+ */
+void Scheduler::start_work(pid_t client) {
+    thread_state* ts = state();
+    priority prio = ts ? ts->prio : FOREGROUND;
+
+    pthread_mutex_lock(&sched_lock);
+    if (prio == FOREGROUND) {
+        client_state& cs = clients[client];
+        ++cs.wanting;
+        while (cs.working >= client_limit()) {
+            pthread_cond_wait(&sched_cond, &sched_lock);
+        }
+        ++cs.working;
+    }
+    ++working[prio];
+    pthread_mutex_unlock(&sched_lock);
+}
+
+/* Note that the calling thread is done encoding for a read by a client. */
+void Scheduler::end_work(pid_t client) {
+    thread_state* ts = state();
+    priority prio = ts ? ts->prio : FOREGROUND;
+
+    pthread_mutex_lock(&sched_lock);
+    if (prio == FOREGROUND) {
+        std::map<pid_t,client_state>::iterator it = clients.find(client);
+        --it->second.working;
+        if (--it->second.wanting == 0) {
+            clients.erase(it);
+        }
+    }
+    --working[prio];
+    pthread_cond_broadcast(&sched_cond);
+    pthread_mutex_unlock(&sched_lock);
+}
+
+/*
+ * Called before each frame is encoded, to wait while work of a higher
+ * priority is going on.
+ */
+void Scheduler::next_frame() {
+    thread_state* ts = state();
+    if (!ts || ts->prio == FOREGROUND) {
+        return;
+    }
+
+    double start = now(CLOCK_MONOTONIC);
+    if (start < ts->boost_until) {
+        return;
+    }
+
+    pthread_mutex_lock(&sched_lock);
+    while (held(ts->prio)) {
+        double waited = now(CLOCK_MONOTONIC) - start;
+        if (waited >= max_wait) {
+            ts->boost_until = now(CLOCK_MONOTONIC) + boost_time;
+            break;
+        }
+        wait_for(max_wait - waited);
+    }
+    pthread_mutex_unlock(&sched_lock);
+}
+
+/*
+ * Note that a client is waiting for prefetch work to finish, which should
+ * then not wait for other clients.
+ */
+void Scheduler::urge_begin() {
+    pthread_mutex_lock(&sched_lock);
+    ++urgent;
+    pthread_cond_broadcast(&sched_cond);
+    pthread_mutex_unlock(&sched_lock);
+}
+
+void Scheduler::urge_end() {
+    pthread_mutex_lock(&sched_lock);
+    --urgent;
+    pthread_mutex_unlock(&sched_lock);
+}
+
+/*
+ * Find the process a thread belongs to, as FUSE reports the ID of the
+ * thread making a request, and the threads of a process are one client.
+ */
+pid_t Scheduler::client_of(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+
+    FILE* status = fopen(path, "r");
+    if (!status) {
+        return pid;
+    }
+
+    char line[128];
+    int tgid;
+    while (fgets(line, sizeof(line), status)) {
+        if (sscanf(line, "Tgid: %d", &tgid) == 1) {
+            pid = tgid;
+            break;
+        }
+    }
+    fclose(status);
+
+    return pid;
+}
+
+/* Check whether the calling thread reads for a client. */
+bool Scheduler::is_foreground() {
+    thread_state* ts = state();
+    return !ts || ts->prio == FOREGROUND;
+}
+
+Scheduler::thread_state* Scheduler::state() {
+    pthread_once(&state_once, create_key);
+    return (thread_state*)pthread_getspecific(state_key);
+}
+
+/*
+ * Check whether work of the given priority must wait. Must be called with
+ * the lock held.
+ */
+bool Scheduler::held(priority prio) {
+    if (prio == PREFETCH && urgent > 0) {
+        return false;
+    }
+
+    for (int i=0; i<prio; ++i) {
+        if (working[i] > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Number of reads a client may encode for at once, which is its share of
+ * the processors among the clients wanting to. Must be called with the
+ * lock held.
+ */
+int Scheduler::client_limit() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    long limit = cpus / (long)clients.size();
+    if (limit < 1) {
+        limit = 1;
+    }
+    if (params.clientjobs && limit > (long)params.clientjobs) {
+        limit = params.clientjobs;
+    }
+
+    return (int)limit;
+}
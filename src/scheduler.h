@@ -0,0 +1,78 @@
+/*
+ * Transcoding work scheduler header for mp3fs
+ *
+ * Copyright (C) 2013 Kristofer Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <sys/types.h>
+
+#include <map>
+
+/*
+ * Orders encoding work by priority. Each thread has a priority, which is
+ * FOREGROUND unless it sets another. Threads count as working while they
+ * encode for a read, and before each frame a thread waits while threads
+ * of a higher priority are working. A thread which has waited for too
+ * long is let through for a while, so that it still makes progress.
+ *
+ * Reads are also shared fairly between client processes: while several
+ * clients want to encode, each may only encode as many files at once as
+ * its share of the processors, and never more than the clientjobs option
+ * allows. Further reads of a client wait for its other reads to finish.
+ */
+class Scheduler {
+public:
+    enum priority {
+        FOREGROUND,     /* Reads by clients */
+        PREFETCH,       /* The file a client is likely to read next */
+        FILL,           /* Files which may be read some time */
+        PRIORITIES
+    };
+
+    static void set_priority(priority prio);
+    static void start_work(pid_t client);
+    static void end_work(pid_t client);
+    static void next_frame();
+    static void urge_begin();
+    static void urge_end();
+    static pid_t client_of(pid_t pid);
+    static bool is_foreground();
+private:
+    struct thread_state {
+        priority prio;
+        double boost_until;
+    };
+
+    /* Reads of a client which are encoding, or waiting to. */
+    struct client_state {
+        int working;
+        int wanting;
+    };
+
+    static thread_state* state();
+    static bool held(priority prio);
+    static int client_limit();
+
+    static int working[PRIORITIES];
+    static int urgent;
+    static std::map<pid_t,client_state> clients;
+};
+
+#endif
@@ -0,0 +1,336 @@
+/*
+ * Rendered tag cache source for mp3fs
+ *
+ * Copyright (C) 2013 Kristofer Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "tag_cache.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <climits>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#include "transcode.h"
+
+namespace {
+
+/* Protects all of the static cache state. */
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Header of a cache file. Variable-length data follows in order. */
+struct disk_header {
+    char magic[8];
+    int64_t mtime;
+    int64_t source_size;
+    uint64_t encoded_size;
+    uint32_t signature_len;
+    uint32_t filename_len;
+    uint32_t start_tag_len;
+    uint32_t end_tag_len;
+};
+
+const char disk_magic[8] = {'M', 'P', '3', 'F', 'S', 'T', 'C', '1'};
+
+/* Sanity limit on tag sizes read from disk. ID3v2 tags max out at 256 MB. */
+const uint32_t max_disk_tag = 256*1024*1024;
+
+/* Copy a vector into the end of a Buffer. */
+bool append(Buffer& buffer, const std::vector<uint8_t>& data) {
+    if (data.empty()) {
+        return true;
+    }
+    return buffer.write(&data[0], data.size()) == data.size();
+}
+
+/* Copy the contents of a Buffer into a vector. */
+bool extract(const Buffer& buffer, std::vector<uint8_t>& data) {
+    data.resize(buffer.tell());
+    return data.empty() || buffer.copy_into(&data[0], 0, data.size());
+}
+
+bool read_fully(FILE* file, void* data, size_t len) {
+    return len == 0 || fread(data, len, 1, file) == 1;
+}
+
+bool write_fully(FILE* file, const void* data, size_t len) {
+    return len == 0 || fwrite(data, len, 1, file) == 1;
+}
+
+}
+
+TagCache::entry_map_t TagCache::entries;
+std::list<std::string> TagCache::lru;
+size_t TagCache::total_size = 0;
+
+/*
+ * Look up the tags for a source file with the given stat information. If
+ * a valid entry is found in memory or on disk, the tags are appended to
+ * the given Buffers, the predicted output size is set, and true is
+ * returned.
+ */
+bool TagCache::lookup(const std::string& filename, const struct stat& st,
+                      Buffer& start_tag, Buffer& end_tag,
+                      size_t& encoded_size) {
+    pthread_mutex_lock(&cache_lock);
+
+    entry_map_t::iterator it = entries.find(filename);
+    if (it != entries.end()) {
+        if (valid(it->second, st)) {
+            lru.splice(lru.begin(), lru, it->second.lru_pos);
+            bool ok = append(start_tag, it->second.start_tag)
+                && append(end_tag, it->second.end_tag);
+            encoded_size = (size_t)it->second.encoded_size;
+            pthread_mutex_unlock(&cache_lock);
+            return ok;
+        }
+
+        /* Source file has changed since the entry was created. */
+        total_size -= it->second.start_tag.size()
+            + it->second.end_tag.size();
+        lru.erase(it->second.lru_pos);
+        entries.erase(it);
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+
+    Entry entry;
+    if (!params.tagcachedir || !disk_read(filename, entry)
+        || !valid(entry, st)) {
+        return false;
+    }
+
+    if (!append(start_tag, entry.start_tag)
+        || !append(end_tag, entry.end_tag)) {
+        return false;
+    }
+    encoded_size = (size_t)entry.encoded_size;
+
+    pthread_mutex_lock(&cache_lock);
+    store(filename, entry);
+    pthread_mutex_unlock(&cache_lock);
+
+    return true;
+}
+
+/*
+ * Add the rendered tags and predicted output size for a source file to
+ * the cache, replacing any previous entry.
+ */
+void TagCache::insert(const std::string& filename, const struct stat& st,
+                      const Buffer& start_tag, const Buffer& end_tag,
+                      size_t encoded_size) {
+    Entry entry;
+    entry.mtime = st.st_mtime;
+    entry.source_size = st.st_size;
+    entry.encoded_size = encoded_size;
+    if (!extract(start_tag, entry.start_tag)
+        || !extract(end_tag, entry.end_tag)) {
+        mp3fs_debug("Cannot copy tags of %s for caching.", filename.c_str());
+        errno = 0;
+        return;
+    }
+
+    if (params.tagcachedir) {
+        disk_write(filename, entry);
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    store(filename, entry);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* Check whether an entry still describes the given source file. */
+bool TagCache::valid(const Entry& entry, const struct stat& st) {
+    return entry.mtime == (int64_t)st.st_mtime
+        && entry.source_size == (int64_t)st.st_size;
+}
+
+/*
+ * Put an entry in the in-memory cache, and make room for it by evicting
+ * the least recently used entries. Must be called with the lock held.
+ */
+void TagCache::store(const std::string& filename, Entry& entry) {
+    size_t entry_size = entry.start_tag.size() + entry.end_tag.size();
+    if (entry_size > (size_t)params.tagcache*1024*1024) {
+        return;
+    }
+
+    entry_map_t::iterator it = entries.find(filename);
+    if (it != entries.end()) {
+        total_size -= it->second.start_tag.size()
+            + it->second.end_tag.size();
+        lru.erase(it->second.lru_pos);
+        entries.erase(it);
+    }
+
+    lru.push_front(filename);
+    Entry& stored = entries[filename];
+    stored.mtime = entry.mtime;
+    stored.source_size = entry.source_size;
+    stored.encoded_size = entry.encoded_size;
+    stored.start_tag.swap(entry.start_tag);
+    stored.end_tag.swap(entry.end_tag);
+    stored.lru_pos = lru.begin();
+    total_size += entry_size;
+
+    evict();
+}
+
+/*
+ * Remove least recently used entries until the cache fits within its
+ * size limit. Must be called with the lock held.
+ */
+void TagCache::evict() {
+    while (total_size > (size_t)params.tagcache*1024*1024 && !lru.empty()) {
+        entry_map_t::iterator it = entries.find(lru.back());
+        total_size -= it->second.start_tag.size()
+            + it->second.end_tag.size();
+        entries.erase(it);
+        lru.pop_back();
+    }
+}
+
+/*
+ * Name of the cache file for a source file, formed from a 64-bit FNV-1a
+ * hash of the name. Collisions are detected by storing the full name in
+ * the file.
+ */
+std::string TagCache::disk_name(const std::string& filename) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i=0; i<filename.size(); ++i) {
+        hash ^= (uint8_t)filename[i];
+        hash *= 1099511628211ULL;
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.tag", (unsigned long long)hash);
+
+    return std::string(params.tagcachedir) + name;
+}
+
+/*
+ * Read an entry from the disk cache, if present and created with the same
+ * parameters.
+ */
+bool TagCache::disk_read(const std::string& filename, Entry& entry) {
+    FILE* file = fopen(disk_name(filename).c_str(), "rb");
+    if (!file) {
+        /* Not really an error. */
+        errno = 0;
+        return false;
+    }
+
+    struct disk_header header;
+    std::string signature, name;
+    bool ok = read_fully(file, &header, sizeof(header))
+        && memcmp(header.magic, disk_magic, sizeof(disk_magic)) == 0
+        && header.start_tag_len <= max_disk_tag
+        && header.end_tag_len <= max_disk_tag
+        && header.signature_len <= PATH_MAX && header.filename_len <= PATH_MAX;
+    if (ok) {
+        signature.resize(header.signature_len);
+        name.resize(header.filename_len);
+        entry.start_tag.resize(header.start_tag_len);
+        entry.end_tag.resize(header.end_tag_len);
+        ok = read_fully(file, signature.empty() ? NULL : &signature[0],
+                        signature.size())
+            && read_fully(file, name.empty() ? NULL : &name[0], name.size())
+            && read_fully(file, entry.start_tag.empty() ? NULL
+                          : &entry.start_tag[0], entry.start_tag.size())
+            && read_fully(file, entry.end_tag.empty() ? NULL
+                          : &entry.end_tag[0], entry.end_tag.size())
+            && signature == param_signature() && name == filename;
+    }
+    fclose(file);
+
+    entry.mtime = header.mtime;
+    entry.source_size = header.source_size;
+    entry.encoded_size = header.encoded_size;
+
+    return ok;
+}
+
+/*
+ * Write an entry to the disk cache. The file is written under a temporary
+ * name and renamed into place, so readers never see a partial entry.
+ * Failure is not fatal, as the entry can always be recreated.
+ */
+void TagCache::disk_write(const std::string& filename, const Entry& entry) {
+    std::string path = disk_name(filename);
+    std::string tmp_path = path + ".XXXXXX";
+
+    int fd = mkstemp(&tmp_path[0]);
+    if (fd == -1) {
+        mp3fs_debug("Cannot create tag cache file for %s: %s",
+                    filename.c_str(), strerror(errno));
+        errno = 0;
+        return;
+    }
+    FILE* file = fdopen(fd, "wb");
+    if (!file) {
+        close(fd);
+        unlink(tmp_path.c_str());
+        errno = 0;
+        return;
+    }
+
+    struct disk_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, disk_magic, sizeof(disk_magic));
+    header.mtime = entry.mtime;
+    header.source_size = entry.source_size;
+    header.encoded_size = entry.encoded_size;
+    std::string signature = param_signature();
+    header.signature_len = (uint32_t)signature.size();
+    header.filename_len = (uint32_t)filename.size();
+    header.start_tag_len = (uint32_t)entry.start_tag.size();
+    header.end_tag_len = (uint32_t)entry.end_tag.size();
+
+    bool ok = write_fully(file, &header, sizeof(header))
+        && write_fully(file, signature.data(), signature.size())
+        && write_fully(file, filename.data(), filename.size())
+        && write_fully(file, entry.start_tag.empty() ? NULL
+                       : &entry.start_tag[0], entry.start_tag.size())
+        && write_fully(file, entry.end_tag.empty() ? NULL
+                       : &entry.end_tag[0], entry.end_tag.size());
+    ok = (fclose(file) == 0) && ok;
+
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) == -1) {
+        mp3fs_debug("Cannot write tag cache file for %s.", filename.c_str());
+        unlink(tmp_path.c_str());
+    }
+    errno = 0;
+}
+
+/*
+ * Describe the program version and parameters which affect the rendered
+ * tags or the output size. Entries on disk created by another version or
+ * with other parameters are ignored.
+ */
+std::string TagCache::param_signature() {
+    std::ostringstream tempstr;
+    tempstr << PACKAGE_VERSION << ":" << params.desttype << ":"
+        << params.bitrate << ":" << params.vbr << ":" << params.maxpics
+        << ":" << params.maxpicsize << ":" << params.frontcover;
+    return tempstr.str();
+}
@@ -0,0 +1,74 @@
+/*
+ * Rendered tag cache header for mp3fs
+ *
+ * Copyright (C) 2013 Kristofer Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef TAG_CACHE_H
+#define TAG_CACHE_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "buffer.h"
+
+/*
+ * Cache of the rendered starting and closing tags of transcoded files,
+ * along with the predicted size of the output. Entries are keyed by the
+ * source file name and are only valid for the source modification time
+ * and size, and the program parameters, with which they were created.
+ * Entries are kept in memory up to a total size, and optionally also
+ * written to a directory so they survive restarts.
+ */
+class TagCache {
+public:
+    static bool lookup(const std::string& filename, const struct stat& st,
+                       Buffer& start_tag, Buffer& end_tag,
+                       size_t& encoded_size);
+    static void insert(const std::string& filename, const struct stat& st,
+                       const Buffer& start_tag, const Buffer& end_tag,
+                       size_t encoded_size);
+private:
+    struct Entry {
+        int64_t mtime;
+        int64_t source_size;
+        uint64_t encoded_size;
+        std::vector<uint8_t> start_tag;
+        std::vector<uint8_t> end_tag;
+        std::list<std::string>::iterator lru_pos;
+    };
+    typedef std::map<std::string,Entry> entry_map_t;
+
+    static bool valid(const Entry& entry, const struct stat& st);
+    static void store(const std::string& filename, Entry& entry);
+    static void evict();
+    static std::string disk_name(const std::string& filename);
+    static bool disk_read(const std::string& filename, Entry& entry);
+    static void disk_write(const std::string& filename, const Entry& entry);
+    static std::string param_signature();
+
+    static entry_map_t entries;
+    static std::list<std::string> lru;
+    static size_t total_size;
+};
+
+#endif
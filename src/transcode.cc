@@ -21,169 +21,727 @@
 
 #include "transcode.h"
 
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <algorithm>
 #include <cerrno>
 #include <cstring>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
 
+#include "cache_filler.h"
 #include "coders.h"
+#include "output_cache.h"
+#include "prefetcher.h"
+#include "scheduler.h"
+#include "tag_cache.h"
 
-/* Transcoder parameters for open mp3 */
+/*
+ * Transcoder parameters for open mp3. The closing tag is rendered when the
+ * file is opened but kept in its own Buffer, so that reads of the end of
+ * the file can be answered before the audio data has been encoded. The
+ * Encoder and Decoder are only created when they are needed, which is
+ * not at all if the tags and size are found in the TagCache and no audio
+ * is read. Once encoding is finished, the output is spilled from the
+ * Buffer into an unnamed file, which can be handed to FUSE by descriptor
+ * and whose pages the kernel can reclaim. The lock is held while the
+ * transcoder is used, so that its Buffer can be spilled from elsewhere
+ * when memory runs short. In streaming mode, only a window of the encoded
+ * data is kept, and the starting tag is kept aside in its own Buffer. If
+ * the complete output is found in the OutputCache, it is read from there
+ * instead. The first read of a transcoder tells the CacheFiller that the
+ * other files in its directory are likely to be played, and reading far
+ * enough into it tells the Prefetcher to start on the next file. In paced
+ * mode, the time and offset at which a client started reading in order
+ * are kept, to tell how far ahead of real time it is.
+ */
 struct transcoder {
     Buffer buffer;
+    Buffer head;
+    Buffer end_tag;
+
+    std::string filename;
+    time_t mtime;
+    off_t source_size;
+    size_t encoded_size;
+    bool finished;
+    bool played;
+    bool prefetched;
+    pid_t client;
+    double pace_start;
+    size_t pace_base;
+    int cache_fd;
 
     Encoder* encoder;
     Decoder* decoder;
+
+    pthread_mutex_t lock;
+    std::list<struct transcoder*>::iterator lru_pos;
 };
 
-/* Use "C" linkage to allow access from C code. */
-extern "C" {
+namespace {
 
-/* Allocate and initialize the transcoder */
+/*
+ * What is known about the data the kernel may have cached for each
+ * transcoded file: the source file it came from, and whether all of it
+ * was correct. Reads of the closing tag before the audio is encoded fill
+ * the audio part of the page with zeroes, and a wrong size prediction
+ * changes the data after the fact. Such data must not be kept.
+ */
+struct page_state {
+    time_t mtime;
+    off_t source_size;
+    bool clean;
+};
 
-struct transcoder* transcoder_new(char* filename) {
-    mp3fs_debug("Creating transcoder object for %s", filename);
+std::map<std::string,page_state> page_states;
+pthread_mutex_t page_state_lock = PTHREAD_MUTEX_INITIALIZER;
 
-    /* Allocate transcoder structure */
-    struct transcoder* trans = new struct transcoder;
-    if (!trans) {
-        goto trans_fail;
+/* Limit on the number of files to track; beyond it, start over. */
+const size_t max_page_states = 4096;
+
+/* Note that the kernel may have cached incorrect data for a file. */
+void mark_unclean(const struct transcoder* trans) {
+    pthread_mutex_lock(&page_state_lock);
+    std::map<std::string,page_state>::iterator it
+        = page_states.find(trans->filename);
+    if (it != page_states.end()) {
+        it->second.clean = false;
     }
+    pthread_mutex_unlock(&page_state_lock);
+}
+
+/*
+ * Open transcoders, least recently read first. When the Buffers together
+ * use more memory than allowed, those of the least recently read
+ * transcoders are spilled to files.
+ */
+std::list<struct transcoder*> transcoders;
+pthread_mutex_t transcoders_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void add_transcoder(struct transcoder* trans) {
+    pthread_mutex_lock(&transcoders_lock);
+    trans->lru_pos = transcoders.insert(transcoders.end(), trans);
+    pthread_mutex_unlock(&transcoders_lock);
+}
+
+void remove_transcoder(struct transcoder* trans) {
+    pthread_mutex_lock(&transcoders_lock);
+    transcoders.erase(trans->lru_pos);
+    pthread_mutex_unlock(&transcoders_lock);
+}
+
+/*
+ * Mark a transcoder as most recently read, and spill Buffers until the
+ * memory limit is met. Transcoders which are in use are skipped rather
+ * than waited for. The victims are chosen and locked under the list lock,
+ * but written out after it is released, so that other reads do not wait
+ * for the writes.
+ */
+void limit_memory(struct transcoder* trans) {
+    size_t limit = (size_t)params.maxmemory * 1024 * 1024;
+    std::vector<struct transcoder*> victims;
+
+    pthread_mutex_lock(&transcoders_lock);
+    transcoders.splice(transcoders.end(), transcoders, trans->lru_pos);
+
+    size_t total = Buffer::total_allocated();
+    std::list<struct transcoder*>::iterator it = transcoders.begin();
+    while (limit && it != transcoders.end() && total > limit) {
+        struct transcoder* victim = *it++;
+        if (pthread_mutex_trylock(&victim->lock) != 0) {
+            continue;
+        }
+
+        size_t allocated = victim->buffer.allocated();
+        if (allocated == 0) {
+            pthread_mutex_unlock(&victim->lock);
+            continue;
+        }
+        victims.push_back(victim);
+        total -= std::min(allocated, total);
+    }
+    pthread_mutex_unlock(&transcoders_lock);
+
+    for (size_t i=0; i<victims.size(); ++i) {
+        struct transcoder* victim = victims[i];
+        mp3fs_debug("Spilling %zu bytes of %s to free memory.",
+                    victim->buffer.allocated(), victim->filename.c_str());
+        if (!victim->buffer.spill()) {
+            mp3fs_error("Unable to spill buffer of %s: %s",
+                        victim->filename.c_str(), strerror(errno));
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+}
+
+/*
+ * Create the Encoder and Decoder for the file and process its metadata.
+ * The Decoder will call the Encoder to set appropriate tag values for the
+ * output file.
+ */
+int open_coders(struct transcoder* trans) {
+    const char* ext = strrchr(trans->filename.c_str(), '.');
 
     /* Create Encoder and Decoder objects. */
     trans->encoder = Encoder::CreateEncoder(params.desttype);
-    trans->decoder = Decoder::CreateDecoder(strrchr(filename, '.') + 1);
+    trans->decoder = ext ? Decoder::CreateDecoder(ext + 1) : NULL;
     if (!trans->encoder || !trans->decoder) {
-        goto endecoder_fail;
+        return -1;
     }
 
     mp3fs_debug("Ready to initialize decoder.");
 
-    if (trans->decoder->open_file(filename) == -1) {
-        goto init_fail;
+    if (trans->decoder->open_file(trans->filename.c_str()) == -1) {
+        return -1;
     }
 
     mp3fs_debug("Decoder initialized successfully.");
 
-    /*
-     * Process metadata. The Decoder will call the Encoder to set appropriate
-     * tag values for the output file.
-     */
     if (trans->decoder->process_metadata(trans->encoder) == -1) {
         mp3fs_debug("Error processing metadata.");
-        goto init_fail;
+        return -1;
     }
 
     mp3fs_debug("Metadata processing finished.");
 
+    return 0;
+}
+
+/*
+ * Render the starting and closing tags from the Encoder and predict the
+ * output size. These are what the TagCache saves for later opens.
+ */
+int render_tags(struct transcoder* trans) {
     /* Render the starting tag from Encoder to Buffer. */
     if (trans->encoder->render_start_tag(trans->buffer) == -1) {
         mp3fs_debug("Error rendering starting tag in Encoder.");
-        goto init_fail;
+        return -1;
+    }
+
+    /* Render the closing tag, to be appended when encoding finishes. */
+    if (trans->encoder->render_close_tag(trans->end_tag) == -1) {
+        mp3fs_debug("Error rendering closing tag in Encoder.");
+        return -1;
     }
 
     mp3fs_debug("Tag written to Buffer.");
 
-    return trans;
+    if (!params.vbr) {
+        trans->encoded_size = trans->encoder->calculate_size();
+        if (trans->encoded_size == 0) {
+            return -1;
+        }
+    }
 
-init_fail:
-endecoder_fail:
-    delete trans->decoder;
-    delete trans->encoder;
+    return 0;
+}
 
-    delete trans;
+/*
+ * Flush the Encoder and append the closing tag once the Decoder has
+ * reached the end of the input.
+ */
+int finish_encoding(struct transcoder* trans) {
+    if (trans->encoder->encode_finish(trans->buffer) == -1) {
+        return -1;
+    }
 
-trans_fail:
-    return NULL;
+    size_t tag_len = trans->end_tag.tell();
+    uint8_t* write_ptr = trans->buffer.write_prepare(tag_len);
+    if (!write_ptr) {
+        return -1;
+    }
+    if (!trans->end_tag.copy_into(write_ptr, 0, tag_len)) {
+        return -1;
+    }
+    trans->buffer.increment_pos(tag_len);
+
+    /*
+     * A CBR size differing from the prediction means the frame layout is
+     * wrong for this input, and clients have been given a wrong size.
+     */
+    if (!params.vbr && trans->buffer.tell() != trans->encoded_size) {
+        mp3fs_error("Encoded %zu bytes of %s instead of the %zu predicted.",
+                    trans->buffer.tell(), trans->filename.c_str(),
+                    trans->encoded_size);
+        mark_unclean(trans);
+    }
+    trans->encoded_size = trans->buffer.tell();
+
+    return 0;
 }
 
-/* Read some bytes into the internal buffer and into the given buffer. */
+/*
+ * In streaming mode, keep a copy of the starting tag, which is all the
+ * Buffer holds at this point.
+ */
+int keep_head(struct transcoder* trans) {
+    if (!params.streamwindow) {
+        return 0;
+    }
 
-ssize_t transcoder_read(struct transcoder* trans, char* buff, off_t offset,
-                        size_t len) {
-    mp3fs_debug("Reading %zu bytes from offset %jd.", len, (intmax_t)offset);
+    size_t head_size = trans->buffer.tell();
+    uint8_t* write_ptr = trans->head.write_prepare(head_size);
+    if (!write_ptr || !trans->buffer.copy_into(write_ptr, 0, head_size)) {
+        return -1;
+    }
+    trans->head.increment_pos(head_size);
+
+    return 0;
+}
+
+/*
+ * Start encoding again from the beginning, because data which has been
+ * discarded is needed again.
+ */
+int restart_encoding(struct transcoder* trans) {
+    mp3fs_debug("Restarting encoding of %s.", trans->filename.c_str());
+
+    transcoder_finish(trans);
+    trans->finished = false;
+    trans->buffer.reset();
+
+    size_t head_size = trans->head.tell();
+    uint8_t* write_ptr = trans->buffer.write_prepare(head_size);
+    if (!write_ptr || !trans->head.copy_into(write_ptr, 0, head_size)) {
+        return -1;
+    }
+    trans->buffer.increment_pos(head_size);
+
+    return 0;
+}
+
+/*
+ * In streaming mode, discard data more than the window behind the end of
+ * the encoded data, but nothing from offset on. Data is discarded a
+ * window at a time, so that what remains is not moved too often.
+ */
+void slide_window(struct transcoder* trans, size_t offset) {
+    size_t window = (size_t)params.streamwindow * 1024;
+    size_t end = trans->buffer.tell();
+    if (!window || end < window) {
+        return;
+    }
+
+    size_t from = std::min(offset, end - window);
+    if (from >= trans->buffer.start() + window) {
+        trans->buffer.discard(from);
+    }
+}
+
+/*
+ * Encode until the Buffer reaches the given end or the input ends, keeping
+ * data from offset on in streaming mode. Background work gives way to
+ * reads between frames.
+ */
+int encode_until(struct transcoder* trans, size_t offset, size_t end) {
+    while (trans->buffer.tell() < end) {
+        Scheduler::next_frame();
+        int stat = trans->decoder->process_single_fr(trans->encoder,
+                                                     &trans->buffer);
+        if (stat == -1) {
+            errno = EIO;
+            return -1;
+        } else if (stat == 1) {
+            /* Transcoding is complete. Append the closing tag. */
+            if (finish_encoding(trans) == -1) {
+                mp3fs_debug("Error finishing encoding.");
+                errno = EIO;
+                return -1;
+            }
+
+            trans->finished = true;
+            if (transcoder_finish(trans) == -1) {
+                errno = EIO;
+                return -1;
+            }
+            if (!params.streamwindow && !trans->buffer.spill()) {
+                mp3fs_debug("Unable to spill finished output: %s",
+                            strerror(errno));
+                errno = 0;
+            }
+            break;
+        }
+
+        slide_window(trans, offset);
+    }
+
+    return 0;
+}
+
+/*
+ * In paced mode, wait before a read which needs encoding for a client so
+ * that the encoded audio stays at most the pace ahead of real time,
+ * counted from when the client started reading in order. Output is
+ * converted to audio time with the rate the Encoder gives, and reads are
+ * not held back until it is known. Reads which skip data not yet encoded,
+ * or go back, start counting again. The transcoder must not be locked, as
+ * other reads of it, such as those of data already encoded, need not
+ * wait.
+ */
+void pace_read(struct transcoder* trans, size_t offset, size_t end) {
+    if (!params.pace || !Scheduler::is_foreground()) {
+        return;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    double now = (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+
+    pthread_mutex_lock(&trans->lock);
+    if (trans->finished || end <= trans->buffer.tell()) {
+        pthread_mutex_unlock(&trans->lock);
+        return;
+    }
+
+    if (trans->pace_start == 0 || offset > trans->buffer.tell()
+        || offset < trans->pace_base) {
+        trans->pace_start = now;
+        trans->pace_base = offset;
+    }
+
+    double rate = trans->encoder ? trans->encoder->output_rate() : 0;
+    double ahead = 0;
+    if (rate > 0) {
+        ahead = (double)(end - trans->pace_base) / rate
+            - (now - trans->pace_start);
+    }
+    pthread_mutex_unlock(&trans->lock);
+
+    if (ahead > params.pace) {
+        double wait = ahead - params.pace;
+        ts.tv_sec = (time_t)wait;
+        ts.tv_nsec = (long)((wait - (double)ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+    }
+}
+
+/*
+ * Read some bytes into the internal buffer and into the given buffer. The
+ * transcoder must be locked.
+ */
+ssize_t read_locked(struct transcoder* trans, char* buff, off_t offset,
+                    size_t len) {
     if (!params.vbr) {
-        if ((size_t)offset > transcoder_get_size(trans)) {
+        size_t size = transcoder_get_size(trans);
+        if ((size_t)offset > size) {
             return 0;
         }
-        if (offset + len > transcoder_get_size(trans)) {
-            len = transcoder_get_size(trans) - offset;
+        if (offset + len > size) {
+            len = size - offset;
         }
 
-        // TODO: Avoid favoring MP3 in program structure.
         /*
-        * If we are encoding to MP3 and the requested data overlaps the ID3v1 tag
-        * at the end of the file, do not encode data first up to that position.
-        * This optimizes the case where applications read the end of the file
-        * first to read the ID3v1 tag.
-        */
-        if (strcmp(params.desttype, "mp3") == 0 &&
-            (size_t)offset > trans->buffer.tell() &&
-            offset + len > (transcoder_get_size(trans) - 128)) {
-            trans->buffer.copy_into((uint8_t*)buff, offset, len);
+         * If the requested data overlaps the closing tag at the end of the
+         * file, do not encode data first up to that position. This
+         * optimizes the case where applications read the end of the file
+         * first to read the ID3v1 tag. Any audio data requested before the
+         * tag has not been encoded yet and reads as zeroes.
+         */
+        size_t tag_start = size - trans->end_tag.tell();
+        if (!trans->finished && (size_t)offset > trans->buffer.tell()
+            && offset + len > tag_start) {
+            size_t from = std::max((size_t)offset, tag_start);
+            if (from > (size_t)offset) {
+                memset(buff, 0, from - offset);
+                mark_unclean(trans);
+            }
+            if (!trans->end_tag.copy_into((uint8_t*)buff + (from - offset),
+                                          from - tag_start,
+                                          offset + len - from)) {
+                errno = EIO;
+                return 0;
+            }
 
             return len;
         }
     }
 
-    if (trans->decoder && trans->encoder) {
-        /* Transcode up to what we need, unless we encounter an error. */
-        while (trans->buffer.tell() < offset + len) {
-            int stat = trans->decoder->process_single_fr(trans->encoder,
-                                                         &trans->buffer);
-            if (stat == -1) {
+    /*
+     * Data before the window has been discarded in streaming mode. The
+     * starting tag is still at hand; anything else has to be encoded
+     * again.
+     */
+    if (params.streamwindow && (size_t)offset < trans->buffer.start()) {
+        size_t head_size = trans->head.tell();
+        if ((size_t)offset < head_size) {
+            size_t head_len = std::min(len, head_size - (size_t)offset);
+            if (!trans->head.copy_into((uint8_t*)buff, offset, head_len)) {
                 errno = EIO;
                 return 0;
-            } else if (stat == 1) {
-                /* Transcoding is complete.  Render the closing tag. */
-                if (trans->encoder->render_close_tag(trans->buffer) == -1) {
-                    mp3fs_debug("Error rendering closing tag in Encoder.");
-                    errno = EIO;
-                    return 0;
-                }
-
-                if (transcoder_finish(trans) == -1) {
-                    errno = EIO;
-                    return 0;
-                }
-                break;
             }
+            if (head_len == len) {
+                return len;
+            }
+
+            errno = 0;
+            ssize_t read = read_locked(trans, buff + head_len,
+                                       offset + head_len, len - head_len);
+            if (read == 0 && errno != 0) {
+                return 0;
+            }
+            return head_len + read;
+        }
+
+        if (restart_encoding(trans) == -1) {
+            mp3fs_error("Error restarting transcoder for %s.",
+                        trans->filename.c_str());
+            errno = EIO;
+            return 0;
+        }
+    }
+
+    if (!trans->finished && trans->buffer.tell() < offset + len) {
+        /*
+         * Start the Encoder and Decoder if the tags came from the cache.
+         * The tags they produce are already in the Buffer.
+         */
+        if (!trans->decoder && open_coders(trans) == -1) {
+            mp3fs_error("Error starting transcoder for %s.",
+                        trans->filename.c_str());
+            transcoder_finish(trans);
+            errno = EIO;
+            return 0;
+        }
+
+        /* Transcode up to what we need, unless we encounter an error. */
+        Scheduler::start_work(trans->client);
+        int ret = encode_until(trans, offset, offset + len);
+        Scheduler::end_work(trans->client);
+        if (ret == -1) {
+            return 0;
         }
     }
 
     /* Truncate if we didn't actually get the full length. */
-    if (trans->buffer.tell() < offset + len) {
-        if ((size_t)offset < trans->buffer.tell()) {
-            len = trans->buffer.tell() - offset;
+    size_t available = trans->finished ? trans->encoded_size
+                                       : trans->buffer.tell();
+    if (available < offset + len) {
+        if ((size_t)offset < available) {
+            len = available - offset;
         } else {
             len = 0;
         }
     }
 
-    trans->buffer.copy_into((uint8_t*)buff, offset, len);
+    if (trans->cache_fd != -1) {
+        ssize_t read = pread(trans->cache_fd, buff, len, offset);
+        return read == -1 ? 0 : read;
+    }
+
+    if (!trans->buffer.copy_into((uint8_t*)buff, offset, len)) {
+        errno = EIO;
+        return 0;
+    }
+    slide_window(trans, offset + len);
 
     return len;
 }
 
-/* Close the input file and free everything but the initial buffer. */
+/*
+ * Check whether reading up to the given offset passes the point at which
+ * the next file is prefetched, the first time it does. As the size of VBR
+ * output is not known before it is encoded, this is only once encoding
+ * has finished for VBR.
+ */
+bool prefetch_due(struct transcoder* trans, size_t end) {
+    if (!params.prefetch || trans->prefetched
+        || (params.vbr && !trans->finished)) {
+        return false;
+    }
+
+    if (end < trans->encoded_size / 100 * params.prefetch) {
+        return false;
+    }
+    trans->prefetched = true;
+    return true;
+}
+
+/*
+ * Account for a read up to the given offset, however it was served: mark
+ * the transcoder as most recently read, and start the background work a
+ * client's reads call for. Reads by the background workers themselves
+ * neither count as played nor start anything, so that a prefetched
+ * transcoder still does both once its client reads it.
+ */
+void after_read(struct transcoder* trans, size_t end) {
+    bool first = false, prefetch = false;
+
+    if (!Prefetcher::is_worker() && !CacheFiller::is_worker()) {
+        pthread_mutex_lock(&trans->lock);
+        first = !trans->played;
+        trans->played = true;
+        prefetch = prefetch_due(trans, end);
+        pthread_mutex_unlock(&trans->lock);
+    }
+
+    int olderrno = errno;
+    limit_memory(trans);
+    if (first) {
+        CacheFiller::add_siblings(trans->filename);
+    }
+    if (prefetch) {
+        Prefetcher::add_next(trans->filename);
+    }
+    errno = olderrno;
+}
+
+}
+
+/* Use "C" linkage to allow access from C code. */
+extern "C" {
+
+/* Allocate and initialize the transcoder */
+
+struct transcoder* transcoder_new(char* filename) {
+    struct stat st;
+
+    mp3fs_debug("Creating transcoder object for %s", filename);
+
+    if (stat(filename, &st) == -1) {
+        return NULL;
+    }
+
+    /* Allocate transcoder structure */
+    struct transcoder* trans = new struct transcoder;
+    if (!trans) {
+        return NULL;
+    }
+
+    trans->filename = filename;
+    trans->mtime = st.st_mtime;
+    trans->source_size = st.st_size;
+    trans->encoded_size = 0;
+    trans->finished = false;
+    trans->played = false;
+    trans->prefetched = false;
+    trans->client = 0;
+    trans->pace_start = 0;
+    trans->pace_base = 0;
+    trans->cache_fd = -1;
+    trans->encoder = NULL;
+    trans->decoder = NULL;
+
+    pthread_mutex_init(&trans->lock, NULL);
+    pthread_mutex_lock(&trans->lock);
+    add_transcoder(trans);
+
+    /* Serve the stored output if there is any for this source file. */
+    if (params.cachedir) {
+        trans->cache_fd = OutputCache::open(trans->filename, st,
+                                            trans->encoded_size);
+        if (trans->cache_fd != -1) {
+            mp3fs_debug("Output found in store.");
+            trans->finished = true;
+            pthread_mutex_unlock(&trans->lock);
+            return trans;
+        }
+    }
+
+    /* Use previously rendered tags if the source file has not changed. */
+    if (TagCache::lookup(trans->filename, st, trans->buffer, trans->end_tag,
+                         trans->encoded_size)) {
+        mp3fs_debug("Tags found in cache.");
+    } else if (open_coders(trans) == -1 || render_tags(trans) == -1) {
+        goto fail;
+    } else {
+        TagCache::insert(trans->filename, st, trans->buffer, trans->end_tag,
+                         trans->encoded_size);
+    }
+
+    if (keep_head(trans) == -1) {
+        goto fail;
+    }
+
+    pthread_mutex_unlock(&trans->lock);
+    return trans;
+
+fail:
+    pthread_mutex_unlock(&trans->lock);
+    transcoder_delete(trans);
+    return NULL;
+}
+
+/*
+ * Get a transcoder for a file which is opened to be read by a client
+ * process: the one prefetched for it if the source file has not changed
+ * since, and otherwise a new one.
+ */
+
+struct transcoder* transcoder_open(char* filename, pid_t client) {
+    struct transcoder* trans = Prefetcher::take(filename);
+    if (trans) {
+        struct stat st;
+        if (stat(filename, &st) == -1 || st.st_mtime != trans->mtime
+            || st.st_size != trans->source_size) {
+            transcoder_delete(trans);
+            trans = NULL;
+        } else {
+            mp3fs_debug("Using prefetched transcoder for %s", filename);
+        }
+    }
+
+    if (!trans) {
+        trans = transcoder_new(filename);
+    }
+    if (trans) {
+        trans->client = Scheduler::client_of(client);
+    }
+
+    return trans;
+}
+
+/* Read some bytes into the internal buffer and into the given buffer. */
+
+ssize_t transcoder_read(struct transcoder* trans, char* buff, off_t offset,
+                        size_t len) {
+    mp3fs_debug("Reading %zu bytes from offset %jd.", len, (intmax_t)offset);
+
+    pace_read(trans, (size_t)offset, (size_t)offset + len);
+
+    CacheFiller::read_started();
+    pthread_mutex_lock(&trans->lock);
+    ssize_t read = read_locked(trans, buff, offset, len);
+    pthread_mutex_unlock(&trans->lock);
+    CacheFiller::read_finished();
+
+    after_read(trans, (size_t)offset + len);
+
+    return read;
+}
+
+/*
+ * Account for a read served through transcoder_fd(), which FUSE does
+ * itself after this returns, the same way as one by transcoder_read().
+ */
+
+void transcoder_fd_read(struct transcoder* trans, off_t offset, size_t len) {
+    CacheFiller::read_started();
+    CacheFiller::read_finished();
+
+    after_read(trans, (size_t)offset + len);
+}
+
+/*
+ * Close the input file and free everything but the buffer. If encoding
+ * was not finished, the buffer holds only what was encoded so far.
+ */
 
 int transcoder_finish(struct transcoder* trans) {
     // flac cleanup
     if (trans->decoder) {
-        delete trans->decoder;
+        trans->decoder->release();
         trans->decoder = NULL;
     }
 
     // lame cleanup
     if (trans->encoder) {
-        int len = trans->encoder->encode_finish(trans->buffer);
-        if (len == -1) {
-            return -1;
-        }
-
-        /* Check encoded buffer size. */
-        mp3fs_debug("Finishing file. Predicted size: %zu, final size: %jd",
-                    trans->encoder->calculate_size(),
-                    (intmax_t)(trans->buffer.tell() + 128));
-        trans->buffer.increment_pos(128);
         delete trans->encoder;
         trans->encoder = NULL;
     }
@@ -194,17 +752,91 @@ int transcoder_finish(struct transcoder* trans) {
 /* Free the transcoder structure. */
 
 void transcoder_delete(struct transcoder* trans) {
+    remove_transcoder(trans);
+    /* Wait for limit_memory() to finish spilling it. */
+    pthread_mutex_lock(&trans->lock);
+    pthread_mutex_unlock(&trans->lock);
     transcoder_finish(trans);
+    if (trans->cache_fd != -1) {
+        close(trans->cache_fd);
+    }
+    pthread_mutex_destroy(&trans->lock);
     delete trans;
 }
 
-/* Return size of output file, as computed by Encoder. */
+/*
+ * Check whether data the kernel cached from an earlier open of the same
+ * file can be kept. This is the case for CBR output if the source file
+ * has not changed and nothing incorrect was served. Otherwise the kernel
+ * discards the cached data, and tracking starts over.
+ */
+int transcoder_keep_cache(struct transcoder* trans) {
+    if (params.vbr) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&page_state_lock);
+    std::map<std::string,page_state>::iterator it
+        = page_states.find(trans->filename);
+    bool keep = it != page_states.end()
+        && it->second.mtime == trans->mtime
+        && it->second.source_size == trans->source_size
+        && it->second.clean;
+    if (!keep) {
+        if (it == page_states.end()
+            && page_states.size() >= max_page_states) {
+            page_states.clear();
+        }
+        page_state& state = page_states[trans->filename];
+        state.mtime = trans->mtime;
+        state.source_size = trans->source_size;
+        state.clean = true;
+    }
+    pthread_mutex_unlock(&page_state_lock);
+
+    return keep;
+}
+
+/*
+ * Return size of output file. Until encoding finishes, this is the size
+ * predicted by the Encoder for CBR, or what has been encoded so far for
+ * VBR.
+ */
 size_t transcoder_get_size(struct transcoder* trans) {
-    if (trans->encoder && !params.vbr) {
-        return trans->encoder->calculate_size();
+    if (trans->finished || !params.vbr) {
+        return trans->encoded_size;
     } else {
         return trans->buffer.tell();
     }
 }
 
+/*
+ * Return the bytes of output per second of audio, or 0 if not known. It
+ * is not known for finished transcoders, which need no pacing.
+ */
+double transcoder_output_rate(struct transcoder* trans) {
+    pthread_mutex_lock(&trans->lock);
+    double rate = trans->encoder ? trans->encoder->output_rate() : 0;
+    pthread_mutex_unlock(&trans->lock);
+
+    return rate;
+}
+
+/*
+ * Return a file descriptor holding the complete output once encoding has
+ * finished, or -1 if the output is still in memory. The descriptor stays
+ * owned by the transcoder and must be read with pread, at most up to the
+ * size of the output, as more data may follow it.
+ */
+int transcoder_fd(struct transcoder* trans) {
+    pthread_mutex_lock(&trans->lock);
+    int fd = trans->cache_fd;
+    if (fd == -1 && trans->finished) {
+        fd = trans->buffer.spilled_fd();
+    }
+    pthread_mutex_unlock(&trans->lock);
+
+    return fd;
+}
+
 }
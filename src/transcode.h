@@ -19,7 +19,10 @@
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
+/* The FUSE API version can be set by configure to build for FUSE 3. */
+#ifndef FUSE_USE_VERSION
 #define FUSE_USE_VERSION 26
+#endif
 
 #include <fuse.h>
 #include <syslog.h>
@@ -34,11 +37,37 @@ extern struct mp3fs_params {
     int gainmode;
     float gainref;
     const char* desttype;
+    int maxpics;
+    unsigned int maxpicsize;
+    int frontcover;
+    unsigned int tagcache;
+    const char* tagcachedir;
+    unsigned int dircache;
+    unsigned int maxmemory;
+    unsigned int streamwindow;
+    const char* cachedir;
+    int cachefill;
+    unsigned int prefetch;
+    unsigned int clientjobs;
+    unsigned int pace;
+    int lowlevel;
+    double attr_timeout;
+    double entry_timeout;
+    double negative_timeout;
 } params;
 
 /* Fuse operations struct */
 extern struct fuse_operations mp3fs_ops;
 
+/* Run the filesystem using the low-level API instead */
+int mp3fs_ll_main(struct fuse_args* args);
+
+/* Set up the connection to the kernel */
+void mp3fs_conn_init(struct fuse_conn_info *conn);
+
+/* Name translation, shared by both APIs */
+void transcoded_name(char* path);
+
 #define mp3fs_debug(f, ...) syslog(LOG_DEBUG, f, ## __VA_ARGS__)
 #define mp3fs_info(f, ...) syslog(LOG_INFO, f, ## __VA_ARGS__)
 #define mp3fs_error(f, ...) syslog(LOG_ERR, f, ## __VA_ARGS__)
@@ -61,11 +90,44 @@ extern "C" {
 
 /* Functions for doing transcoding, called by main program body */
 struct transcoder* transcoder_new(char* filename);
+struct transcoder* transcoder_open(char* filename, pid_t client);
 ssize_t transcoder_read(struct transcoder* trans, char* buff, off_t offset,
                         size_t len);
 int transcoder_finish(struct transcoder* trans);
 void transcoder_delete(struct transcoder* trans);
 size_t transcoder_get_size(struct transcoder* trans);
+double transcoder_output_rate(struct transcoder* trans);
+int transcoder_fd(struct transcoder* trans);
+void transcoder_fd_read(struct transcoder* trans, off_t offset, size_t len);
+int transcoder_keep_cache(struct transcoder* trans);
+
+/*
+ * Directory listing cache, used by readdir. The filler function is given
+ * each name with its file type, or NULL if unknown, and returns nonzero
+ * to stop the listing.
+ */
+typedef int (*dircache_filler_t)(void* buf, const char* name,
+                                 const struct stat* st);
+int dircache_readdir(const char* dirname, void* buf,
+                     dircache_filler_t filler);
+int dircache_find_original(char* path);
+int dircache_absent(const char* path);
+void dircache_add_absent(const char* path, time_t since);
+
+/*
+ * Store of complete transcoded files, filled by mp3fs-warm or in the
+ * background and served on open. The throttle function, if given, is
+ * called with the amount of output produced after each chunk. Threads
+ * which only fill the store call outputcache_worker() first, so that
+ * their work is not limited to a client's share of the processors.
+ */
+typedef void (*outputcache_throttle_t)(size_t bytes);
+int outputcache_check(const char* filename);
+int outputcache_fill(const char* filename, outputcache_throttle_t throttle);
+void outputcache_worker(void);
+
+/* Start filling the store in the background, if enabled. */
+void cachefill_start(void);
 
 /* Check for availability of audio types. */
 int check_encoder(const char* type);
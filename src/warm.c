@@ -0,0 +1,499 @@
+/*
+ * mp3fs-warm: transcode a source directory ahead of time into the store
+ * which mp3fs serves with the cachedir option, so that files do not have
+ * to be encoded when they are first played.
+ *
+ * Copyright (C) 2013 Kristofer Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "transcode.h"
+
+/* Encoding parameters, which must match those given to mp3fs. */
+struct mp3fs_params params = {
+    .basepath   = NULL,
+    .bitrate    = 128,
+    .vbr        = 0,
+    .quality    = 5,
+    .debug      = 0,
+    .gainmode   = 1,
+    .gainref    = 89.0,
+#ifdef HAVE_MP3
+    .desttype  = "mp3",
+#endif
+    .maxpics    = -1,
+    .maxpicsize = 0,
+    .frontcover = 0,
+    .tagcache   = 32,
+    /* Files are read once from start to end. */
+    .streamwindow = 256,
+    .cachedir   = NULL,
+};
+
+/* Options of this program only */
+static struct warm_params {
+    unsigned int jobs;
+    unsigned int rate;
+    int nice;
+    int idle;
+    int quiet;
+} warm_params = {
+    .jobs       = 0,
+    .rate       = 0,
+    .nice       = 10,
+    .idle       = 0,
+    .quiet      = 0,
+};
+
+enum {
+    KEY_HELP,
+};
+
+/* What became of a file, as reported for each one. */
+enum fill_status {
+    FILL_PRESENT,
+    FILL_STORED,
+    FILL_FAILED,
+};
+
+static const char* const fill_status_names[] = {
+    [FILL_PRESENT] = "present",
+    [FILL_STORED]  = "stored",
+    [FILL_FAILED]  = "failed",
+};
+
+/*
+ * Age in seconds beyond which an unlocked temporary file in the store is
+ * taken to be left behind. Writers lock their files right after creating
+ * them, so this only has to cover that moment.
+ */
+#define PARTIAL_AGE 60
+
+#define MP3FS_OPT(t, p, v) { t, offsetof(struct mp3fs_params, p), v }
+#define WARM_OPT(t, p, v) { t, offsetof(struct warm_params, p), v }
+
+static struct fuse_opt mp3fs_opts[] = {
+    MP3FS_OPT("--quality=%u",     quality, 0),
+    MP3FS_OPT("quality=%u",       quality, 0),
+    MP3FS_OPT("-d",               debug, 1),
+    MP3FS_OPT("debug",            debug, 1),
+    MP3FS_OPT("-b %u",            bitrate, 0),
+    MP3FS_OPT("bitrate=%u",       bitrate, 0),
+    MP3FS_OPT("-v",               vbr, 1),
+    MP3FS_OPT("vbr",              vbr, 1),
+    MP3FS_OPT("--gainmode=%d",    gainmode, 0),
+    MP3FS_OPT("gainmode=%d",      gainmode, 0),
+    MP3FS_OPT("--gainref=%f",     gainref, 0),
+    MP3FS_OPT("gainref=%f",       gainref, 0),
+    MP3FS_OPT("--desttype=%s",    desttype, 0),
+    MP3FS_OPT("desttype=%s",      desttype, 0),
+    MP3FS_OPT("--maxpics=%d",     maxpics, 0),
+    MP3FS_OPT("maxpics=%d",       maxpics, 0),
+    MP3FS_OPT("--maxpicsize=%u",  maxpicsize, 0),
+    MP3FS_OPT("maxpicsize=%u",    maxpicsize, 0),
+    MP3FS_OPT("--frontcover",     frontcover, 1),
+    MP3FS_OPT("frontcover",       frontcover, 1),
+    FUSE_OPT_END
+};
+
+static struct fuse_opt warm_opts[] = {
+    WARM_OPT("-j %u",             jobs, 0),
+    WARM_OPT("--jobs=%u",         jobs, 0),
+    WARM_OPT("--rate=%u",         rate, 0),
+    WARM_OPT("--nice=%d",         nice, 0),
+    WARM_OPT("--idle",            idle, 1),
+    WARM_OPT("-q",                quiet, 1),
+    WARM_OPT("--quiet",           quiet, 1),
+
+    FUSE_OPT_KEY("-h",            KEY_HELP),
+    FUSE_OPT_KEY("--help",        KEY_HELP),
+    FUSE_OPT_END
+};
+
+/* Source files to transcode, and how far the workers have got */
+static char** files;
+static size_t file_count;
+static size_t file_alloc;
+static size_t next_file;
+static size_t stored, present, failed;
+static pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Time at which the next output may be produced under the rate limit */
+static double rate_next;
+static pthread_mutex_t rate_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void usage(char *name) {
+    printf("Usage: %s [OPTION]... FLACDIR CACHEDIR\n", name);
+    fputs("\
+Transcode all files in FLACDIR into CACHEDIR, to be served by mp3fs with\n\
+the same encoding options and -ocachedir=CACHEDIR. Files already stored\n\
+are skipped, so an interrupted run can be continued.\n\
+\n\
+Encoding options are those of mp3fs: -b, -v, --quality, --gainmode,\n\
+--gainref, --desttype, --maxpics, --maxpicsize, --frontcover, and their\n\
+-o forms.\n\
+\n\
+Options:\n\
+    -j N, --jobs=N         number of files to transcode at once: defaults\n\
+                           to the number of processors\n\
+    --rate=KB              produce at most KB kilobytes of output per\n\
+                           second in total; by default there is no limit\n\
+    --nice=N               scheduling niceness to run at: defaults to 10\n\
+    --idle                 only do disk I/O when no other program does\n\
+    -q, --quiet            do not report progress for each file\n\
+    -d                     enable debug output\n\
+    -h, --help             display this help and exit\n\
+\n", stdout);
+}
+
+/* Keep options other than encoding options for the second pass. */
+static int mp3fs_opt_proc(void* data, const char* arg, int key,
+                          struct fuse_args *outargs) {
+    (void)data;
+    (void)arg;
+    (void)key;
+    (void)outargs;
+    return 1;
+}
+
+static int warm_opt_proc(void* data, const char* arg, int key,
+                         struct fuse_args *outargs) {
+    (void)data;
+    switch(key) {
+        case FUSE_OPT_KEY_NONOPT:
+            if (!params.basepath) {
+                params.basepath = arg;
+                return 0;
+            } else if (!params.cachedir) {
+                params.cachedir = arg;
+                return 0;
+            }
+            break;
+
+        case KEY_HELP:
+            usage(outargs->argv[0]);
+            exit(0);
+    }
+
+    fprintf(stderr, "Unknown option: %s\n\n", arg);
+    return -1;
+}
+
+/* Add a file to the list of files to transcode. */
+static int add_file(const char* path) {
+    if (file_count == file_alloc) {
+        size_t alloc = file_alloc ? 2*file_alloc : 256;
+        char** newfiles = realloc(files, alloc*sizeof(char*));
+        if (!newfiles) {
+            return -1;
+        }
+        files = newfiles;
+        file_alloc = alloc;
+    }
+    files[file_count] = strdup(path);
+    if (!files[file_count]) {
+        return -1;
+    }
+    file_count++;
+
+    return 0;
+}
+
+/*
+ * Add each file under a directory with a decoder for its type to the
+ * list. Symbolic links are not followed.
+ */
+static int collect_files(const char* dirname) {
+    DIR* dp;
+    struct dirent* de;
+    struct stat st;
+    char path[PATH_MAX];
+    int ret = 0;
+
+    dp = opendir(dirname);
+    if (!dp) {
+        return -1;
+    }
+
+    while (ret == 0 && (de = readdir(dp))) {
+        const char* ext = strrchr(de->d_name, '.');
+
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dirname, de->d_name);
+        if (lstat(path, &st) == -1) {
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            ret = collect_files(path);
+        } else if (S_ISREG(st.st_mode) && ext && check_decoder(ext + 1)) {
+            ret = add_file(path);
+        }
+    }
+
+    closedir(dp);
+    return ret;
+}
+
+/*
+ * Remove temporary files left behind by an interrupted run. Files still
+ * locked are being written, by another run or by a running mp3fs filling
+ * the same store, and are left alone.
+ */
+static void remove_partial(void) {
+    DIR* dp = opendir(params.cachedir);
+    struct dirent* de;
+    time_t now = time(NULL);
+
+    if (!dp) {
+        return;
+    }
+    while ((de = readdir(dp))) {
+        char path[PATH_MAX];
+        struct stat st;
+        int fd;
+
+        if (!strstr(de->d_name, ".out.")) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", params.cachedir, de->d_name);
+
+        fd = open(path, O_RDONLY | O_NOFOLLOW);
+        if (fd == -1) {
+            continue;
+        }
+        if (fstat(fd, &st) == 0 && st.st_mtime < now - PARTIAL_AGE
+            && flock(fd, LOCK_EX | LOCK_NB) == 0) {
+            unlink(path);
+        }
+        close(fd);
+    }
+    closedir(dp);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/*
+ * Wait as long as needed to keep the total output produced by all
+ * workers within the rate limit.
+ */
+static void throttle(size_t bytes) {
+    double wait;
+
+    pthread_mutex_lock(&rate_lock);
+    double current = now();
+    if (rate_next < current) {
+        rate_next = current;
+    }
+    rate_next += (double)bytes / (warm_params.rate * 1024.0);
+    wait = rate_next - current;
+    pthread_mutex_unlock(&rate_lock);
+
+    if (wait > 0) {
+        struct timespec ts;
+        ts.tv_sec = (time_t)wait;
+        ts.tv_nsec = (long)((wait - (double)ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+    }
+}
+
+/* Take files from the list and store them until none are left. */
+static void* worker(void* arg) {
+    (void)arg;
+
+    outputcache_worker();
+
+    while (1) {
+        pthread_mutex_lock(&files_lock);
+        if (next_file == file_count) {
+            pthread_mutex_unlock(&files_lock);
+            break;
+        }
+        size_t index = next_file++;
+        pthread_mutex_unlock(&files_lock);
+
+        enum fill_status status;
+        if (outputcache_check(files[index])) {
+            status = FILL_PRESENT;
+        } else if (outputcache_fill(files[index], warm_params.rate
+                                    ? throttle : NULL) == -1) {
+            status = FILL_FAILED;
+        } else {
+            status = FILL_STORED;
+        }
+
+        pthread_mutex_lock(&files_lock);
+        switch (status) {
+            case FILL_PRESENT:
+                present++;
+                break;
+            case FILL_STORED:
+                stored++;
+                break;
+            case FILL_FAILED:
+                failed++;
+                break;
+        }
+        if (!warm_params.quiet || status == FILL_FAILED) {
+            printf("[%zu/%zu] %s: %s\n", present + stored + failed,
+                   file_count, files[index] + strlen(params.basepath),
+                   fill_status_names[status]);
+            fflush(stdout);
+        }
+        pthread_mutex_unlock(&files_lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * Lower the CPU and I/O priority of the process. Threads created
+ * afterward inherit both.
+ */
+static void lower_priority(void) {
+    errno = 0;
+    if (warm_params.nice && nice(warm_params.nice) == -1 && errno != 0) {
+        fprintf(stderr, "Cannot change niceness: %s\n", strerror(errno));
+    }
+
+#ifdef SYS_ioprio_set
+    if (warm_params.idle) {
+        /* IOPRIO_WHO_PROCESS, and IOPRIO_CLASS_IDLE in the class bits */
+        if (syscall(SYS_ioprio_set, 1, 0, 3 << 13) == -1) {
+            fprintf(stderr, "Cannot change I/O priority: %s\n",
+                    strerror(errno));
+        }
+    }
+#else
+    if (warm_params.idle) {
+        fprintf(stderr, "I/O priorities are not supported.\n");
+    }
+#endif
+}
+
+int main(int argc, char *argv[]) {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct stat st;
+    pthread_t* threads;
+    unsigned int i;
+
+    if (fuse_opt_parse(&args, &params, mp3fs_opts, mp3fs_opt_proc)
+        || fuse_opt_parse(&args, &warm_params, warm_opts, warm_opt_proc)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (!params.basepath || !params.cachedir) {
+        fprintf(stderr, "FLACDIR and CACHEDIR must be given.\n\n");
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (params.basepath[0] != '/' || params.cachedir[0] != '/') {
+        fprintf(stderr, "FLACDIR and CACHEDIR must be absolute paths.\n\n");
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (stat(params.basepath, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "flacdir is not a valid directory: %s\n",
+                params.basepath);
+        return 1;
+    }
+
+    if (stat(params.cachedir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "cachedir is not a valid directory: %s\n",
+                params.cachedir);
+        return 1;
+    }
+
+    if (params.quality > 9) {
+        fprintf(stderr, "Invalid encoding quality value: %u\n\n",
+                params.quality);
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (!check_encoder(params.desttype)) {
+        fprintf(stderr, "No encoder available for desttype: %s\n\n",
+                params.desttype);
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (!warm_params.jobs) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        warm_params.jobs = cpus > 0 ? (unsigned int)cpus : 1;
+    }
+
+    /* Log to the screen if debug is enabled. */
+    openlog("mp3fs-warm", params.debug ? LOG_PERROR : 0, LOG_USER);
+
+    remove_partial();
+
+    if (collect_files(params.basepath) == -1) {
+        fprintf(stderr, "Error reading %s: %s\n", params.basepath,
+                strerror(errno));
+        return 1;
+    }
+
+    lower_priority();
+
+    threads = malloc(warm_params.jobs * sizeof(pthread_t));
+    if (!threads) {
+        return 1;
+    }
+    for (i=0; i<warm_params.jobs; ++i) {
+        if (pthread_create(&threads[i], NULL, worker, NULL) != 0) {
+            break;
+        }
+    }
+    if (i == 0) {
+        worker(NULL);
+    }
+    while (i > 0) {
+        pthread_join(threads[--i], NULL);
+    }
+    free(threads);
+
+    printf("%zu stored, %zu already present, %zu failed\n", stored,
+           present, failed);
+
+    fuse_opt_free_args(&args);
+
+    return failed ? 1 : 0;
+}
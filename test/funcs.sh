@@ -1,12 +1,31 @@
 PATH=$PWD/../src:$PATH
 export LC_ALL=C
 
+# Source directory for mount_mp3fs, and directories removed on exit
+FLACDIR="$PWD/flac"
+TEMPDIRS=
+
+unmount () {
+    if hash fusermount3 2>&-; then
+        fusermount3 -u "$1"
+    elif hash fusermount 2>&-; then
+        fusermount -u "$1"
+    else
+        umount "$1"
+    fi
+    rmdir "$1"
+}
+
 cleanup () {
     EXIT=$?
     # Errors are no longer fatal
     set +e
-    hash fusermount 2>&- && fusermount -u "$DIRNAME" || umount "$DIRNAME"
-    rmdir "$DIRNAME"
+    for dir in $MOUNTED; do
+        unmount "$dir"
+    done
+    for dir in $TEMPDIRS; do
+        rm -rf "$dir"
+    done
     exit $EXIT
 }
 
@@ -14,12 +33,19 @@ mp3fserr () {
     exit 99
 }
 
+# Mount FLACDIR with MP3FS_OPTS and the given options on a new MOUNTDIR
+mount_mp3fs () {
+    MOUNTDIR="$(mktemp -d)"
+    MOUNTED="$MOUNTED $MOUNTDIR"
+    ( mp3fs -d $MP3FS_OPTS "$@" "$FLACDIR" "$MOUNTDIR" || kill -USR1 $$ ) &
+    while ! mount | grep -q "$MOUNTDIR" ; do
+        sleep 0.1
+    done
+}
+
 set -e
 trap cleanup EXIT
 trap mp3fserr USR1
 
-DIRNAME="$(mktemp -d)"
-( mp3fs -d "$PWD/flac" "$DIRNAME" || kill -USR1 $$ ) &
-while ! mount | grep -q "$DIRNAME" ; do
-    sleep 0.1
-done
+mount_mp3fs
+DIRNAME="$MOUNTDIR"
@@ -0,0 +1,84 @@
+/*
+ * Read ranges of a file through a single descriptor for mp3fs tests
+ *
+ * Copyright (C) 2013 Kristofer Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Open a file once and copy the given ranges of it to stdout in order,
+ * reading each in blocks of the given size. Reading them through one
+ * descriptor keeps the same transcoder in use for all of them.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int main(int argc, char* argv[]) {
+    size_t block;
+    char* buf;
+    int fd, i;
+
+    if (argc < 5 || argc % 2 == 0) {
+        fprintf(stderr, "Usage: %s FILE BLOCKSIZE OFFSET LENGTH "
+                "[OFFSET LENGTH]...\n", argv[0]);
+        return 2;
+    }
+
+    block = (size_t)strtoul(argv[2], NULL, 10);
+    buf = malloc(block);
+    if (!block || !buf) {
+        fprintf(stderr, "Invalid block size: %s\n", argv[2]);
+        return 2;
+    }
+
+    fd = open(argv[1], O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+
+    for (i=3; i<argc; i+=2) {
+        off_t offset = (off_t)strtoll(argv[i], NULL, 10);
+        size_t length = (size_t)strtoul(argv[i+1], NULL, 10);
+
+        while (length > 0) {
+            size_t size = length < block ? length : block;
+            ssize_t ret = pread(fd, buf, size, offset);
+            if (ret == -1) {
+                fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+                return 1;
+            } else if (ret == 0) {
+                break;
+            }
+            if (fwrite(buf, (size_t)ret, 1, stdout) != 1) {
+                return 1;
+            }
+            offset += ret;
+            length -= (size_t)ret;
+        }
+    }
+
+    close(fd);
+    free(buf);
+    return fclose(stdout) == 0 ? 0 : 1;
+}
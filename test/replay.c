@@ -0,0 +1,574 @@
+/*
+ * Access-pattern replay benchmark for mp3fs
+ *
+ * Copyright (C) 2013 Kristofer Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Replay a trace of file system operations against a mounted mp3fs and
+ * report latency percentiles for each kind of operation. A trace is a
+ * text file with one operation per line, with paths relative to the
+ * mount point:
+ *
+ *   stat PATH                  lstat() a single path
+ *   probe PATH                 lstat() a path which need not exist
+ *   stattree DIR               lstat() every entry below DIR
+ *   readdir DIR                list a single directory
+ *   readtree DIR               list DIR and every directory below it
+ *   read PATH OFFSET LENGTH    open, read LENGTH bytes at OFFSET, close
+ *   head PATH LENGTH           read the first LENGTH bytes (ID3v2 probe)
+ *   tail PATH LENGTH           read the last LENGTH bytes (ID3v1 probe)
+ *   stream PATH BLOCKSIZE      read the whole file sequentially
+ *   seek PATH COUNT LENGTH     COUNT reads of LENGTH at random offsets
+ *   sleep MSEC                 pause between operations
+ *
+ * Any operation may be prefixed with "repeat N" to run it N times in a
+ * row, or with "concurrent N" to run N copies of it in parallel threads.
+ * Blank lines and lines starting with '#' are ignored.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Kinds of individual operations for which latency is recorded. */
+enum {
+    OP_STAT,
+    OP_READDIR,
+    OP_OPEN,
+    OP_READ,
+    OP_CLOSE,
+    NUM_OPS
+};
+
+static const char* op_names[NUM_OPS] = {
+    "stat", "readdir", "open", "read", "close",
+};
+
+/* Latency samples, in microseconds, for one kind of operation. */
+struct samples {
+    double* data;
+    size_t count;
+    size_t alloc;
+};
+
+static struct samples latency[NUM_OPS];
+static pthread_mutex_t latency_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long errors;
+static const char* root;
+
+/* A parsed trace line. */
+struct op {
+    char cmd[16];
+    char path[PATH_MAX];
+    long long arg1;
+    long long arg2;
+    unsigned int seed;
+};
+
+static double now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void record(int op, double start) {
+    double elapsed = now_usec() - start;
+    struct samples* s = &latency[op];
+
+    pthread_mutex_lock(&latency_lock);
+    if (s->count == s->alloc) {
+        size_t alloc = s->alloc ? s->alloc * 2 : 1024;
+        double* data = realloc(s->data, alloc * sizeof(double));
+        if (!data) {
+            pthread_mutex_unlock(&latency_lock);
+            return;
+        }
+        s->data = data;
+        s->alloc = alloc;
+    }
+    s->data[s->count++] = elapsed;
+    pthread_mutex_unlock(&latency_lock);
+}
+
+static void failed(const char* what, const char* path) {
+    pthread_mutex_lock(&latency_lock);
+    ++errors;
+    pthread_mutex_unlock(&latency_lock);
+    fprintf(stderr, "%s %s: %s\n", what, path, strerror(errno));
+}
+
+/*
+ * Timed wrappers around the system calls being measured. A missing file is
+ * not counted as an error by timed_lstat() if may_fail is set.
+ */
+static int timed_lstat(const char* path, struct stat* st, int may_fail) {
+    double start = now_usec();
+    int ret = lstat(path, st);
+    record(OP_STAT, start);
+    if (ret == -1 && !(may_fail && errno == ENOENT)) {
+        failed("stat", path);
+    }
+    return ret;
+}
+
+static int timed_open(const char* path) {
+    double start = now_usec();
+    int fd = open(path, O_RDONLY);
+    record(OP_OPEN, start);
+    if (fd == -1) {
+        failed("open", path);
+    }
+    return fd;
+}
+
+static ssize_t timed_pread(int fd, char* buf, size_t len, off_t offset,
+                           const char* path) {
+    double start = now_usec();
+    ssize_t ret = pread(fd, buf, len, offset);
+    record(OP_READ, start);
+    if (ret == -1) {
+        failed("read", path);
+    }
+    return ret;
+}
+
+static void timed_close(int fd) {
+    double start = now_usec();
+    close(fd);
+    record(OP_CLOSE, start);
+}
+
+/*
+ * Check whether a directory entry is a directory, asking the file system
+ * when the entry type is not reported.
+ */
+static int is_dir(DIR* dp, struct dirent* de) {
+    struct stat st;
+
+    if (de->d_type != DT_UNKNOWN) {
+        return de->d_type == DT_DIR;
+    }
+    if (fstatat(dirfd(dp), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+        return 0;
+    }
+    return S_ISDIR(st.st_mode);
+}
+
+/*
+ * List a directory, timing the whole listing as one operation. If recurse
+ * is set, descend into subdirectories, and if stat_entries is set, lstat()
+ * every entry found.
+ */
+static void walk(const char* path, int recurse, int stat_entries) {
+    char child[PATH_MAX];
+    struct dirent* de;
+    char** subdirs = NULL;
+    size_t nsubdirs = 0;
+    size_t i;
+
+    double start = now_usec();
+    DIR* dp = opendir(path);
+    if (!dp) {
+        failed("opendir", path);
+        return;
+    }
+
+    while ((de = readdir(dp))) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        if (recurse && is_dir(dp, de)) {
+            char** tmp = realloc(subdirs, (nsubdirs + 1) * sizeof(char*));
+            if (tmp) {
+                subdirs = tmp;
+                subdirs[nsubdirs++] = strdup(de->d_name);
+            }
+        }
+    }
+    closedir(dp);
+    record(OP_READDIR, start);
+
+    if (stat_entries) {
+        dp = opendir(path);
+        while (dp && (de = readdir(dp))) {
+            struct stat st;
+            if (strcmp(de->d_name, ".") == 0
+                || strcmp(de->d_name, "..") == 0) {
+                continue;
+            }
+            snprintf(child, sizeof(child), "%s/%s", path, de->d_name);
+            timed_lstat(child, &st, 0);
+        }
+        if (dp) {
+            closedir(dp);
+        }
+    }
+
+    for (i=0; i<nsubdirs; ++i) {
+        if (subdirs[i]) {
+            snprintf(child, sizeof(child), "%s/%s", path, subdirs[i]);
+            walk(child, recurse, stat_entries);
+            free(subdirs[i]);
+        }
+    }
+    free(subdirs);
+}
+
+/* Read LENGTH bytes at OFFSET, where a negative offset counts from EOF. */
+static void read_range(const char* path, long long offset, long long length) {
+    char* buf = malloc(length > 0 ? (size_t)length : 1);
+    int fd;
+    if (!buf) {
+        return;
+    }
+    fd = timed_open(path);
+    if (fd == -1) {
+        free(buf);
+        return;
+    }
+
+    if (offset < 0) {
+        struct stat st;
+        if (fstat(fd, &st) == 0) {
+            offset += st.st_size;
+            if (offset < 0) {
+                offset = 0;
+            }
+        }
+    }
+
+    timed_pread(fd, buf, (size_t)length, (off_t)offset, path);
+    timed_close(fd);
+    free(buf);
+}
+
+/* Read a whole file front to back in blocks of the given size. */
+static void stream(const char* path, long long blocksize) {
+    char* buf = malloc((size_t)blocksize);
+    off_t offset = 0;
+    ssize_t len;
+    int fd;
+    if (!buf) {
+        return;
+    }
+    fd = timed_open(path);
+    if (fd == -1) {
+        free(buf);
+        return;
+    }
+
+    while ((len = timed_pread(fd, buf, (size_t)blocksize, offset, path)) > 0) {
+        offset += len;
+    }
+
+    timed_close(fd);
+    free(buf);
+}
+
+/* Perform a number of reads at random offsets within a single open. */
+static void seek(const char* path, long long count, long long length,
+                 unsigned int seed) {
+    char* buf = malloc((size_t)length);
+    struct stat st;
+    long long i;
+    int fd;
+    if (!buf) {
+        return;
+    }
+    fd = timed_open(path);
+    if (fd == -1) {
+        free(buf);
+        return;
+    }
+
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        for (i=0; i<count; ++i) {
+            off_t offset = (off_t)(rand_r(&seed) % st.st_size);
+            timed_pread(fd, buf, (size_t)length, offset, path);
+        }
+    }
+
+    timed_close(fd);
+    free(buf);
+}
+
+static void run_op(const struct op* op) {
+    char path[2 * PATH_MAX];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/%s", root, op->path);
+
+    if (strcmp(op->cmd, "stat") == 0) {
+        timed_lstat(path, &st, 0);
+    } else if (strcmp(op->cmd, "probe") == 0) {
+        timed_lstat(path, &st, 1);
+    } else if (strcmp(op->cmd, "stattree") == 0) {
+        walk(path, 1, 1);
+    } else if (strcmp(op->cmd, "readdir") == 0) {
+        walk(path, 0, 0);
+    } else if (strcmp(op->cmd, "readtree") == 0) {
+        walk(path, 1, 0);
+    } else if (strcmp(op->cmd, "read") == 0) {
+        read_range(path, op->arg1, op->arg2);
+    } else if (strcmp(op->cmd, "head") == 0) {
+        read_range(path, 0, op->arg1);
+    } else if (strcmp(op->cmd, "tail") == 0) {
+        read_range(path, -op->arg1, op->arg1);
+    } else if (strcmp(op->cmd, "stream") == 0) {
+        stream(path, op->arg1 > 0 ? op->arg1 : 4096);
+    } else if (strcmp(op->cmd, "seek") == 0) {
+        seek(path, op->arg1, op->arg2 > 0 ? op->arg2 : 4096, op->seed);
+    } else if (strcmp(op->cmd, "sleep") == 0) {
+        usleep((useconds_t)(op->arg1 * 1000));
+    }
+}
+
+static void* run_thread(void* data) {
+    run_op((const struct op*)data);
+    return NULL;
+}
+
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const struct samples* s, double pct) {
+    size_t idx = (size_t)(pct / 100.0 * (double)(s->count - 1) + 0.5);
+    return s->data[idx];
+}
+
+/* Read user+system CPU time in seconds used by another process. */
+static double process_cpu(pid_t pid) {
+    char path[64];
+    char buf[1024];
+    unsigned long utime, stime;
+    char* p;
+    FILE* f;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+    if (!fgets(buf, sizeof(buf), f)) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    /* Skip past the command name, which may contain spaces. */
+    p = strrchr(buf, ')');
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                     "%lu %lu", &utime, &stime) != 2) {
+        return -1;
+    }
+
+    return (double)(utime + stime) / (double)sysconf(_SC_CLK_TCK);
+}
+
+static double self_cpu(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+        + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "Usage: %s [-p PID] MOUNTPOINT [TRACE]...\n"
+            "Replay access traces against MOUNTPOINT. If no TRACE is "
+            "given, read from stdin.\n"
+            "With -p, also report CPU time used by process PID.\n", name);
+}
+
+static int replay(FILE* trace, const char* name) {
+    char line[PATH_MAX + 64];
+    unsigned int lineno = 0;
+
+    while (fgets(line, sizeof(line), trace)) {
+        struct op op;
+        char* p = line;
+        long count = 1;
+        int concurrent = 0;
+        int n;
+
+        ++lineno;
+        while (*p == ' ' || *p == '\t') ++p;
+        if (*p == '#' || *p == '\n' || *p == '\0') {
+            continue;
+        }
+
+        if (sscanf(p, "repeat %ld %n", &count, &n) == 1) {
+            p += n;
+        } else if (sscanf(p, "concurrent %ld %n", &count, &n) == 1) {
+            concurrent = 1;
+            p += n;
+        }
+
+        memset(&op, 0, sizeof(op));
+        if (sscanf(p, "%15s %n", op.cmd, &n) != 1) {
+            fprintf(stderr, "%s:%u: parse error\n", name, lineno);
+            return -1;
+        }
+        p += n;
+        if (strcmp(op.cmd, "sleep") == 0) {
+            sscanf(p, "%lld", &op.arg1);
+        } else {
+            /* Path is the first word; numeric arguments follow it. */
+            if (sscanf(p, "%4095s %lld %lld", op.path, &op.arg1,
+                       &op.arg2) < 1) {
+                fprintf(stderr, "%s:%u: missing path\n", name, lineno);
+                return -1;
+            }
+        }
+        op.seed = lineno;
+
+        if (concurrent) {
+            pthread_t* threads = calloc((size_t)count, sizeof(pthread_t));
+            struct op* ops = calloc((size_t)count, sizeof(struct op));
+            long i, started;
+            int err = 0;
+            if (!threads || !ops) {
+                free(threads);
+                free(ops);
+                return -1;
+            }
+            for (started=0; started<count; ++started) {
+                ops[started] = op;
+                ops[started].seed = lineno * 7919 + (unsigned int)started;
+                err = pthread_create(&threads[started], NULL, run_thread,
+                                     &ops[started]);
+                if (err) {
+                    fprintf(stderr, "%s:%u: creating thread: %s\n", name,
+                            lineno, strerror(err));
+                    break;
+                }
+            }
+            for (i=0; i<started; ++i) {
+                pthread_join(threads[i], NULL);
+            }
+            free(threads);
+            free(ops);
+            if (err) {
+                return -1;
+            }
+        } else {
+            long i;
+            for (i=0; i<count; ++i) {
+                run_op(&op);
+                ++op.seed;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    pid_t pid = 0;
+    double wall, cpu, fs_cpu = -1;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "p:h")) != -1) {
+        switch (opt) {
+            case 'p':
+                pid = (pid_t)atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 2;
+    }
+    root = argv[optind++];
+
+    if (pid) {
+        fs_cpu = process_cpu(pid);
+    }
+    cpu = self_cpu();
+    wall = now_usec();
+
+    if (optind == argc) {
+        if (replay(stdin, "<stdin>") == -1) {
+            return 2;
+        }
+    }
+    for (i=optind; i<argc; ++i) {
+        FILE* trace = fopen(argv[i], "r");
+        if (!trace) {
+            fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+            return 2;
+        }
+        if (replay(trace, argv[i]) == -1) {
+            fclose(trace);
+            return 2;
+        }
+        fclose(trace);
+    }
+
+    wall = (now_usec() - wall) / 1e6;
+    cpu = self_cpu() - cpu;
+    if (pid && fs_cpu >= 0) {
+        fs_cpu = process_cpu(pid) - fs_cpu;
+    }
+
+    printf("%-8s %8s %10s %10s %10s %10s %10s\n", "op", "count",
+           "p50(us)", "p90(us)", "p99(us)", "max(us)", "total(ms)");
+    for (i=0; i<NUM_OPS; ++i) {
+        struct samples* s = &latency[i];
+        double total = 0;
+        size_t j;
+        if (!s->count) {
+            continue;
+        }
+        qsort(s->data, s->count, sizeof(double), compare_double);
+        for (j=0; j<s->count; ++j) {
+            total += s->data[j];
+        }
+        printf("%-8s %8zu %10.1f %10.1f %10.1f %10.1f %10.1f\n", op_names[i],
+               s->count, percentile(s, 50), percentile(s, 90),
+               percentile(s, 99), s->data[s->count - 1], total / 1e3);
+        free(s->data);
+    }
+
+    printf("\nwall time:   %.3f s\n", wall);
+    printf("replay cpu:  %.3f s\n", cpu);
+    if (pid && fs_cpu >= 0) {
+        printf("mp3fs cpu:   %.3f s\n", fs_cpu);
+    }
+    printf("errors:      %lu\n", errors);
+
+    return errors ? 1 : 0;
+}
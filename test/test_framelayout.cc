@@ -0,0 +1,161 @@
+/*
+ * MP3 frame layout test for mp3fs
+ *
+ * Copyright (C) 2013 Kristofer Henriksson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Check Mp3FrameLayout against frame sizes and rate choices known from
+ * LAME, and its padding against a frame by frame simulation of how LAME
+ * pads, for every sample rate and bitrate.
+ */
+
+#include "mp3_frame_layout.h"
+
+#include <cstdio>
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const char* what, int rate, int bitrate) {
+    if (!ok) {
+        fprintf(stderr, "%s wrong for %d Hz, %d kbps\n", what, rate, bitrate);
+        ++failures;
+    }
+}
+
+/* Output rate and bitrate LAME chooses for some inputs. */
+const struct {
+    int input_rate;
+    int channels;
+    int bitrate;
+    int sample_rate;
+    int out_bitrate;
+} choices[] = {
+    { 44100, 2, 128, 44100, 128 },
+    { 48000, 2, 128, 48000, 128 },
+    { 96000, 2, 128, 48000, 128 },
+    { 44100, 2,  64, 24000,  64 },
+    { 44100, 1,  64, 44100,  64 },
+    { 44100, 2,   8,  8000,   8 },
+    { 32000, 2, 320, 32000, 320 },
+    { 22050, 2, 320, 22050, 160 },
+    { 11025, 2, 128, 11025,  64 },
+};
+
+/* Unpadded frame sizes, which kept their rate and bitrate above. */
+const struct {
+    int input_rate;
+    int bitrate;
+    uint64_t frame_size;
+} frame_sizes[] = {
+    { 44100, 128,  417 },
+    { 48000, 128,  384 },
+    { 32000, 320, 1440 },
+    { 24000,  64,  192 },
+    { 22050,  64,  208 },
+    {  8000,   8,   72 },
+};
+
+/*
+ * Audio sizes for a number of input samples. The last two are obama.flac
+ * in test/flac, as test_filesize checks it, with and without resampling.
+ */
+const struct {
+    int input_rate;
+    int bitrate;
+    uint64_t num_samples;
+    uint64_t frames;
+    uint64_t size;
+} audio_sizes[] = {
+    { 44100, 128,      0,   1,   417 },
+    { 44100, 128,  44100,  40, 16718 },
+    { 96000, 128,  96000,  43, 16512 },
+    { 44100, 128, 264600, 231, 96548 },
+    { 44100,  64, 264600, 252, 48384 },
+};
+
+const int rates[] = {
+    48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000
+};
+
+/* Compare the padding with what LAME does frame by frame. */
+void check_padding(int input_rate, int bitrate) {
+    Mp3FrameLayout layout(input_rate, 2, bitrate);
+    int rate = layout.sample_rate();
+    uint64_t frame_bits = (uint64_t)(rate >= 32000 ? 2 : 1) * 72000
+        * layout.bitrate();
+
+    int64_t frac = (int64_t)(frame_bits % rate);
+    int64_t slot_lag = frac;
+    uint64_t padded = 0;
+    for (uint64_t frames=1; frames<=20000; ++frames) {
+        slot_lag -= frac;
+        if (slot_lag < 0) {
+            slot_lag += rate;
+            ++padded;
+        }
+        if (layout.padded_frames(frames) != padded) {
+            check(false, "Padding", input_rate, bitrate);
+            return;
+        }
+    }
+}
+
+}
+
+int main() {
+    for (size_t i=0; i<sizeof(choices)/sizeof(choices[0]); ++i) {
+        Mp3FrameLayout layout(choices[i].input_rate, choices[i].channels,
+                              choices[i].bitrate);
+        check(layout.sample_rate() == choices[i].sample_rate
+              && layout.bitrate() == choices[i].out_bitrate,
+              "Output format", choices[i].input_rate, choices[i].bitrate);
+    }
+
+    for (size_t i=0; i<sizeof(frame_sizes)/sizeof(frame_sizes[0]); ++i) {
+        Mp3FrameLayout layout(frame_sizes[i].input_rate, 2,
+                              frame_sizes[i].bitrate);
+        check(layout.frame_size() == frame_sizes[i].frame_size,
+              "Frame size", frame_sizes[i].input_rate,
+              frame_sizes[i].bitrate);
+    }
+
+    for (size_t i=0; i<sizeof(audio_sizes)/sizeof(audio_sizes[0]); ++i) {
+        Mp3FrameLayout layout(audio_sizes[i].input_rate, 2,
+                              audio_sizes[i].bitrate);
+        check(layout.frame_count(audio_sizes[i].num_samples)
+              == audio_sizes[i].frames
+              && layout.audio_size(audio_sizes[i].num_samples)
+              == audio_sizes[i].size,
+              "Audio size", audio_sizes[i].input_rate,
+              audio_sizes[i].bitrate);
+    }
+
+    for (size_t i=0; i<sizeof(rates)/sizeof(rates[0]); ++i) {
+        for (int bitrate=8; bitrate<=320; bitrate+=8) {
+            check_padding(rates[i], bitrate);
+        }
+    }
+
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}